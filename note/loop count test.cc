@@ -1,5 +1,6 @@
 // This code is to test how much while loop iterates
 // in random_unit_vector() at vec3.h to show there is small overhead.
+// (random_unit_vector() has since been replaced by a closed form sampler in sampling.h)
 #include <iostream>
 #include <random>
 #include <cmath>
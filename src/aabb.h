@@ -36,33 +36,49 @@ public:
 
     bool hit(const ray& r, interval ray_t) const
     {
+        // Slab test on the ray's precomputed inverse direction, without branches : the 
+        // direction's sign picks which bound is entered first, and the entry/exit distances 
+        // are folded in with min/max selects. (Ize, "Robust BVH Ray Traversal")
+        // - An axis parallel ray whose origin lies on a slab plane gives 0 * inf = NaN. The
+        //   selects are written so a NaN never replaces the running interval, i.e. that
+        //   axis doesn't clip the ray.
+        // - The exit distance is scaled up by 1 + 2*gamma(3), the bound of the rounding in 
+        //   its three operations, so rays grazing an edge never miss a box they touch.
+        static const double unit_roundoff = std::numeric_limits<double>::epsilon() / 2;
+        static const double exit_scale = 1 + 2 * (3 * unit_roundoff / (1 - 3 * unit_roundoff));
+
         const point3& ray_orig = r.origin();
-        const vec3&   ray_dir = r.direction();
+        const vec3&   inv_dir = r.inv_direction();
 
         for (int axis = 0; axis < 3; axis++)
         {
             const interval& ax = axis_interval(axis);
-            const double adinv = 1.0 / ray_dir[axis];  // "/d"
-
-            // ex) for x-axis, x0 = ax.min / x1 = ax.max
-            auto t0 = (ax.min - ray_orig[axis]) * adinv;
-            auto t1 = (ax.max - ray_orig[axis]) * adinv;
-
-            if(t0 < t1) 
-            {
-                if(t0 > ray_t.min) ray_t.min = t0;
-                if(t1 < ray_t.max) ray_t.max = t1;
-            }
-            else
-            {
-                if(t1 > ray_t.min) ray_t.min = t1;
-                if(t0 < ray_t.max) ray_t.max = t0;
-            }
-
-            if (ray_t.max <= ray_t.min)
-                return false;
+            bool negative = r.is_negative(axis);
+
+            auto t_enter = ((negative ? ax.max : ax.min) - ray_orig[axis]) * inv_dir[axis];
+            auto t_exit  = ((negative ? ax.min : ax.max) - ray_orig[axis]) * inv_dir[axis] * exit_scale;
+
+            ray_t.min = t_enter > ray_t.min ? t_enter : ray_t.min;
+            ray_t.max = t_exit < ray_t.max ? t_exit : ray_t.max;
         }
-        return true;
+        return ray_t.min <= ray_t.max;
+    }
+
+    double surface_area() const
+    {
+        // Used as the probability of a random ray hitting the box. (SAH)
+        auto dx = std::fmax(0.0, x.size());
+        auto dy = std::fmax(0.0, y.size());
+        auto dz = std::fmax(0.0, z.size());
+        return 2 * (dx*dy + dy*dz + dz*dx);
+    }
+
+    aabb padded(double minimum) const
+    {
+        // Widens the axes thinner than "minimum" to that size, so flat objects (a quad in an 
+        // axis plane) still get a box with a volume.
+        auto pad = [minimum](const interval& i) { return i.size() < minimum ? i.expand(minimum) : i; };
+        return aabb(pad(x), pad(y), pad(z));
     }
 
     int longest_axis() const
@@ -76,6 +92,16 @@ public:
     static const aabb empty, universe;
 };
 
+aabb operator+(const aabb& bbox, const vec3& offset)
+{
+    return aabb(bbox.x + offset.x(), bbox.y + offset.y(), bbox.z + offset.z());
+}
+
+aabb operator+(const vec3& offset, const aabb& bbox)
+{
+    return bbox + offset;
+}
+
 const aabb aabb::empty    = aabb(interval::empty,    interval::empty,    interval::empty);
 const aabb aabb::universe = aabb(interval::universe, interval::universe, interval::universe);
 
@@ -0,0 +1,139 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "camera.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Keyframed animation. Times are in seconds, values are linearly interpolated between
+// keys and held constant before the first and after the last key.
+template <typename T>
+class keyframes
+{
+public:
+    void add(double time, const T& value)
+    {
+        // Keys can be added in any order, they're kept sorted by time.
+        auto key = std::make_pair(time, value);
+        auto after = std::upper_bound(keys.begin(), keys.end(), key,
+            [](const std::pair<double,T>& a, const std::pair<double,T>& b) { return a.first < b.first; });
+        keys.insert(after, key);
+    }
+
+    bool empty() const { return keys.empty(); }
+
+    T at(double time) const
+    {
+        if(time <= keys.front().first) return keys.front().second;
+        if(time >= keys.back().first) return keys.back().second;
+
+        size_t k = 1;
+        while(keys[k].first < time) k++;
+
+        auto a = (time - keys[k-1].first) / (keys[k].first - keys[k-1].first);
+        return (1 - a) * keys[k-1].second + a * keys[k].second;
+    }
+
+private:
+    std::vector<std::pair<double,T>> keys;
+};
+
+class animated : public hittable
+{
+public:
+    // Moves an object along keyframed offsets from where it was built.
+    // The offset is set per frame (set_time), not per ray, so the object doesn't need to
+    // be rebuilt and the acceleration structure above it only needs a refit.
+    // Translation only : no keyframed rotation or scale. Those would have to turn the ray
+    // direction and the hit normal too, and bound the transformed box for the refit.
+    keyframes<vec3> offsets;
+
+    animated(shared_ptr<hittable> object) : object(object), bbox(object->bounding_box()) {}
+
+    void set_time(double time)
+    {
+        offset = offsets.empty() ? vec3(0,0,0) : offsets.at(time);
+        bbox = object->bounding_box() + offset;
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    {
+        // Move the ray into the object's space instead of moving the object.
+        ray offset_r = r.with_origin(r.origin() - offset);
+        if(!object->hit(offset_r, ray_t, rec)) return false;
+
+        rec.p += offset;
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override
+    {
+        return object->occluded(r.with_origin(r.origin() - offset), ray_t);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override
+    {
+        return object->pdf_value(origin - offset, direction);
+    }
+
+    vec3 random(const point3& origin, double u1, double u2) const override
+    {
+        return object->random(origin - offset, u1, u2);
+    }
+
+    bool is_moving() const override { return object->is_moving(); }
+
+    void refit() override
+    {
+        object->refit();
+        bbox = object->bounding_box() + offset;
+    }
+
+private:
+    shared_ptr<hittable> object;
+    vec3 offset;
+    aabb bbox;
+};
+
+class scene_animation
+{
+public:
+    int     frames              = 0;            // Number of frames, 0 : render a still image
+    double  frame_time          = 1.0 / 24.0;   // Seconds between frames
+    std::string output_prefix   = "frame";      // Frames are written to "<prefix>_0000.ppm", ...
+    double  rebuild_threshold   = 1.5;          // Rebuild the BVH once refits grew its nodes this much
+
+    // Camera keyframes, settings without keys keep their camera value.
+    keyframes<point3> lookfrom;
+    keyframes<point3> lookat;
+    keyframes<double> vfov;
+    keyframes<double> focus_dist;
+
+    // Objects to move each frame. Add the returned wrapper to the world (and lights)
+    // instead of the object itself.
+    std::vector<shared_ptr<animated>> objects;
+
+    shared_ptr<animated> animate(shared_ptr<hittable> object)
+    {
+        auto wrapper = make_shared<animated>(object);
+        objects.push_back(wrapper);
+        return wrapper;
+    }
+
+    void set_time(double time, camera& cam) const
+    {
+        if(!lookfrom.empty()) cam.lookfrom = lookfrom.at(time);
+        if(!lookat.empty()) cam.lookat = lookat.at(time);
+        if(!vfov.empty()) cam.vfov = vfov.at(time);
+        if(!focus_dist.empty()) cam.focus_dist = focus_dist.at(time);
+
+        for(const auto& object : objects) object->set_time(time);
+    }
+};
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+// Scene arena : one owner for every object of a scene.
+//
+// Objects are placement-constructed one after another in large blocks (with their own
+// alignment), instead of one heap allocation plus one reference count block each. The arena
+// hands out non-owning shared_ptrs (aliasing an empty owner), so they plug into the existing
+// shared_ptr based interfaces, copying them costs no atomic reference counting, and nothing
+// is freed until the arena itself is destroyed : then every destructor runs (in reverse order)
+// and the blocks are released at once.
+//
+// The scene keeps its arena as the first member so it outlives the world and lights lists
+// that point into it. Pointers from an arena must not be kept beyond its scene.
+//
+// intern() additionally hash-conses immutable objects such as materials and textures :
+// constructing the same type with the same arguments twice returns the first object.
+// Arguments are compared by value (numbers, colors, strings) or by address (shared_ptrs).
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class scene_arena
+{
+public:
+    scene_arena() {}
+
+    ~scene_arena()
+    {
+        for(auto k = destructors.size(); k-- > 0;)
+            destructors[k].destroy(destructors[k].object);
+        for(auto block : blocks) std::free(block);
+    }
+
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args)
+    {
+        void* memory = allocate(sizeof(T), alignof(T));
+        T* object = new (memory) T(std::forward<Args>(args)...);
+        destructors.push_back(destructor_entry{ object, &destroy<T> });
+        object_count++;
+        return shared_ptr<T>(shared_ptr<T>(), object);
+    }
+
+    template <typename T, typename... Args>
+    shared_ptr<T> intern(Args&&... args)
+    {
+        std::string key = typeid(T).name();
+        append_key(key, args...);
+
+        auto found = interned.find(key);
+        if(found != interned.end())
+        {
+            interned_hits++;
+            return shared_ptr<T>(shared_ptr<T>(), static_cast<T*>(found->second));
+        }
+
+        auto object = make<T>(std::forward<Args>(args)...);
+        interned[key] = object.get();
+        return object;
+    }
+
+    size_t objects() const { return object_count; }
+    size_t deduplicated() const { return interned_hits; }
+    size_t bytes_reserved() const { return reserved; }
+
+private:
+    struct destructor_entry
+    {
+        void* object;
+        void (*destroy)(void*);
+    };
+
+    static const size_t block_size = 64 * 1024;
+
+    std::vector<char*> blocks;
+    char* cursor = nullptr;
+    char* block_end = nullptr;
+    size_t reserved = 0;
+    size_t object_count = 0;
+    size_t interned_hits = 0;
+    std::vector<destructor_entry> destructors;
+    std::unordered_map<std::string, void*> interned;
+
+    template <typename T>
+    static void destroy(void* object) { static_cast<T*>(object)->~T(); }
+
+    void* allocate(size_t size, size_t align)
+    {
+        auto address = reinterpret_cast<uintptr_t>(cursor);
+        auto aligned = (address + align - 1) & ~uintptr_t(align - 1);
+
+        if(cursor == nullptr || aligned + size > reinterpret_cast<uintptr_t>(block_end))
+        {
+            // New block. malloc's alignment covers every scene type (no over-aligned members),
+            // objects larger than a block get a block of their own.
+            size_t bytes = size > block_size ? size : block_size;
+            auto block = static_cast<char*>(std::malloc(bytes));
+            if(block == nullptr) throw std::bad_alloc();
+            blocks.push_back(block);
+            reserved += bytes;
+            cursor = block;
+            block_end = block + bytes;
+            aligned = reinterpret_cast<uintptr_t>(cursor);
+        }
+
+        cursor = reinterpret_cast<char*>(aligned + size);
+        return reinterpret_cast<void*>(aligned);
+    }
+
+    /* Hash-consing keys : the bytes of every constructor argument */
+
+    static void append_bytes(std::string& key, const void* data, size_t size)
+    {
+        key.append(static_cast<const char*>(data), size);
+    }
+
+    static void append_key(std::string& key) {}
+
+    template <typename First, typename... Rest>
+    static void append_key(std::string& key, const First& first, const Rest&... rest)
+    {
+        append_arg(key, first);
+        append_key(key, rest...);
+    }
+
+    static void append_arg(std::string& key, double x) { append_bytes(key, &x, sizeof(x)); }
+    static void append_arg(std::string& key, int x) { append_bytes(key, &x, sizeof(x)); }
+
+    static void append_arg(std::string& key, const vec3& v)
+    {
+        for(int k = 0; k < 3; k++) append_arg(key, v[k]);
+    }
+
+    static void append_arg(std::string& key, const std::string& text)
+    {
+        // Length first, so ("ab","c") and ("a","bc") stay different.
+        append_arg(key, int(text.size()));
+        key += text;
+    }
+
+    static void append_arg(std::string& key, const char* text) { append_arg(key, std::string(text)); }
+
+    template <typename U>
+    static void append_arg(std::string& key, const shared_ptr<U>& object)
+    {
+        const void* address = object.get();
+        append_bytes(key, &address, sizeof(address));
+    }
+};
+
+#endif
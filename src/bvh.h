@@ -2,23 +2,187 @@
 #define BVH_H
 
 #include "aabb.h"
+#include "arena.h"
 
 #include <algorithm>
+#include <cmath>
+#include <vector>
+
+// Moves the objects that would dominate a BVH out of "objects" and returns them : unbounded
+// ones (planes), and ones whose box has more than outlier_ratio times the surface area of
+// the bounds of everything left (a radius 1000 ground sphere under a few small spheres).
+// Inside a BVH such an object inflates the root and every node on its path, so nearly every
+// ray descends there and tests it deep in the tree; next to the BVH it costs one test per ray.
+// Checked from the largest box down, stopping at the first object that isn't an outlier.
+inline std::vector<shared_ptr<hittable>> split_bvh_outliers(
+    std::vector<shared_ptr<hittable>>& objects, double outlier_ratio = 4.0, size_t max_outliers = 16
+)
+{
+    std::vector<shared_ptr<hittable>> outliers;
+
+    std::vector<size_t> order(objects.size());
+    for(size_t k = 0; k < order.size(); k++) order[k] = k;
+    size_t candidates = std::min(order.size(), max_outliers);
+    std::partial_sort(order.begin(), order.begin() + candidates, order.end(), [&](size_t a, size_t b)
+    {
+        return objects[a]->bounding_box().surface_area() > objects[b]->bounding_box().surface_area();
+    });
+
+    // The outliers are always the first candidates, so when candidate c is checked everything
+    // left is the candidates after it plus the other objects : rest_after[c + 1], suffix 
+    // bounds over the candidates on top of the bounds of the other objects. (one pass over
+    // the objects instead of one per candidate)
+    std::vector<bool> candidate(objects.size(), false);
+    for(size_t c = 0; c < candidates; c++) candidate[order[c]] = true;
+    std::vector<aabb> rest_after(candidates + 1, aabb::empty);
+    for(size_t k = 0; k < objects.size(); k++)
+        if(!candidate[k]) rest_after[candidates] = aabb(rest_after[candidates], objects[k]->bounding_box());
+    for(size_t c = candidates; c-- > 0;)
+        rest_after[c] = aabb(rest_after[c + 1], objects[order[c]]->bounding_box());
+
+    size_t split = 0;
+    for(; split < candidates; split++)
+    {
+        auto box = objects[order[split]]->bounding_box();
+        bool unbounded = std::isinf(box.x.size()) || std::isinf(box.y.size()) || std::isinf(box.z.size());
+        if(unbounded) continue;
+
+        // Unbounded objects always go, a bounded one only if something stays in the BVH
+        if(objects.size() - split <= 1) break;
+        if(box.surface_area() <= outlier_ratio * rest_after[split + 1].surface_area()) break;
+    }
+    if(split == 0) return outliers;
+
+    std::vector<bool> removed(objects.size(), false);
+    for(size_t c = 0; c < split; c++)
+    {
+        removed[order[c]] = true;
+        outliers.push_back(objects[order[c]]);
+    }
+    size_t kept = 0;
+    for(size_t k = 0; k < objects.size(); k++)
+        if(!removed[k]) objects[kept++] = objects[k];
+    objects.resize(kept);
+    return outliers;
+}
 
 class bvh_node : public hittable
 {
 public:
-    bvh_node(hittable_list list) : bvh_node(list.objects, 0, list.objects.size())
+    bvh_node(hittable_list list) : bvh_node(list.objects, nullptr)
     {
         // There's a C++ subtlety here : Delegating constructor.
         // This constructor (without span indices) creates an implicit copy 
         // of the hittable list, which we will modify. The life time of the copied
         // list only extends until this constructor exits. That's OK, because 
         // we only need to persist the resulting bounding volume hierarchy.
+        //
+        // A BVH over a whole list keeps its outliers (split_bvh_outliers) out of the tree : 
+        // the root holds them next to the tree over everything else.
+    }
+
+    bvh_node(hittable_list list, scene_arena* arena) : bvh_node(list.objects, arena) {}
+
+    bvh_node(
+        std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, scene_arena* arena = nullptr
+    )
+    {
+        build(objects, start, end, arena);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    {
+        if(!bbox.hit(r, ray_t)) return false;
+
+        bool hit_left = left->hit(r, ray_t, rec);
+        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+
+        return hit_left || hit_right;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override
+    {
+        // Any hit will do : no interval shrinking, and the right side is skipped after a hit.
+        // Single object nodes have left == right, their object is only tested once.
+        return bbox.hit(r, ray_t) 
+            && (left->occluded(r, ray_t) || (right != left && right->occluded(r, ray_t)));
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void refit() override
+    {
+        // Bottom-up refit : keeps the tree topology and only grows/shrinks the boxes to the
+        // objects' current bounds. O(n), much cheaper than a rebuild, but the tree gets worse
+        // the further objects move away from where they were when it was built.
+        left->refit();
+        if(right != left) right->refit();
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+        update_growth();
+    }
+
+    bool is_moving() const override { return moving; }
+
+    int inner_nodes() const { return node_count; }   // This node and all inner nodes below
+
+    double refit_growth() const
+    {
+        // How much refits have degraded the tree : the average over inner nodes of their 
+        // surface area relative to the area right after the build. The chance of a ray visiting
+        // a node grows with its area (SAH), so 1.5 means roughly 50% more node visits.
+        // Averaged per node so one huge object (a ground sphere) near the root doesn't hide 
+        // the nodes that did grow.
+        return growth_sum / node_count;
+    }
+
+private:
+    bvh_node(std::vector<shared_ptr<hittable>>& objects, scene_arena* arena)
+    {
+        // Root over a whole list. Without outliers it's the plain root of the tree, with them
+        // the left child is the tree and the right one the outliers (in a list if several).
+        // Rays then test the outliers once, after the tree, as if they were next to it.
+        auto outliers = split_bvh_outliers(objects);
+        if(outliers.empty())
+        {
+            build(objects, 0, objects.size(), arena);
+            return;
+        }
+
+        shared_ptr<hittable> kept_out = outliers[0];
+        if(outliers.size() > 1)
+        {
+            auto list = arena ? arena->make<hittable_list>() : make_shared<hittable_list>();
+            for(const auto& object : outliers) list->add(object);
+            kept_out = list;
+        }
+
+        if(!objects.empty())
+        {
+            size_t end = objects.size();
+            if(arena) left_node = arena->make<bvh_node>(objects, size_t(0), end, arena);
+            else left_node = make_shared<bvh_node>(objects, size_t(0), end);
+        }
+        left = left_node ? left_node : kept_out;
+        right = kept_out;
+        bbox = aabb(left->bounding_box(), right->bounding_box());
+
+        finish_build();
     }
 
-    bvh_node(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end)
+    shared_ptr<hittable> left;
+    shared_ptr<hittable> right;
+    shared_ptr<bvh_node> left_node;     // Same as left/right when they're inner nodes, else null
+    shared_ptr<bvh_node> right_node;
+    aabb bbox;
+    double built_area = 0;              // Surface area when the tree was built
+    double growth_sum = 0;              // Sum of area / built_area of this and all inner nodes below
+    int node_count = 1;                 // This and all inner nodes below
+    bool moving = false;                // Anything below depends on the ray time
+
+    void build(std::vector<shared_ptr<hittable>>& objects, size_t start, size_t end, scene_arena* arena)
     {
+        // arena : where to allocate the inner nodes, the heap if null. From an arena the nodes
+        // are laid out contiguously in depth first order, the order traversal visits them.
         // int axis = random_int(0,2);  // bulid bbox by split along random axis
         // Build the bounding box of the span of source objects
         bbox = aabb::empty;
@@ -49,29 +213,41 @@ public:
             std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
 
             auto mid = start + object_span/2;
-            left = make_shared<bvh_node>(objects, start, mid);
-            right = make_shared<bvh_node>(objects, mid, end);
+            if(arena)
+            {
+                left_node = arena->make<bvh_node>(objects, start, mid, arena);
+                right_node = arena->make<bvh_node>(objects, mid, end, arena);
+            }
+            else
+            {
+                left_node = make_shared<bvh_node>(objects, start, mid);
+                right_node = make_shared<bvh_node>(objects, mid, end);
+            }
+            left = left_node;
+            right = right_node;
         }
 
+        finish_build();
+
         // bbox = aabb(left->bounding_box(), right->bounding_box());
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    void finish_build()
     {
-        if(!bbox.hit(r, ray_t)) return false;
-
-        bool hit_left = left->hit(r, ray_t, rec);
-        bool hit_right = right->hit(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
-
-        return hit_left || hit_right;
+        built_area = bbox.surface_area();
+        update_growth();
+        moving = left->is_moving() || right->is_moving();
     }
 
-    aabb bounding_box() const override { return bbox; }
-
-private:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb bbox;
+    void update_growth()
+    {
+        // A root holding an unbounded outlier has an infinite area, it counts as not grown.
+        auto area = bbox.surface_area();
+        growth_sum = built_area > 0 && std::isfinite(built_area) ? area / built_area : 1.0;
+        node_count = 1;
+        if(left_node) { growth_sum += left_node->growth_sum; node_count += left_node->node_count; }
+        if(right_node) { growth_sum += right_node->growth_sum; node_count += right_node->node_count; }
+    }
 
     static bool box_compare(
         const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis_index
@@ -98,4 +274,4 @@ private:
     }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,12 +1,23 @@
 #ifndef CAMERA_H
 #define CAMERA_H
 
+#include "denoiser.h"
+#include "framebuffer.h"
 #include "material.h"
+#include "preview.h"
+#include "sampler.h"
+#include "thread_pool.h"
 
-enum class Render_mode
-{
-    NORMAL, MATERIAL
-};
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
 
 class camera
 {
@@ -25,39 +36,187 @@ public:
     double defocus_angle = 0;           // Variabtion angle of rays through each pixel
     double focus_dist = 10;             // Distance from camera lookfrom point to plane of perfect focus
 
+    bool    sky_gradient = true;        // Lerped white to skyblue sky, or a constant background
+    color   background = color(0,0,0);  // Scene background color when sky_gradient is false
+
+    Sampler_type sampler_type = Sampler_type::SOBOL;    // Source of each sample's uniform numbers
+    uint32_t     seed         = 0;                      // Sampler seed, same seed gives the same image
+
+    int     threads     = 0;            // Render threads, 0 : one per hardware thread
+    int     tile_size   = 16;           // Tile edge in pixels, the unit of work for a thread
+    bool    pin_threads = false;        // Pin render threads to CPUs across the NUMA nodes (numa.h)
+
+    // Copies of the world, one per NUMA node of a pinned pool and each built on its node
+    // (scene::replicate_per_node). Threads trace against their node's copy when the world
+    // being rendered is node_worlds[0].
+    std::vector<const hittable*> node_worlds;
+
+    bool    denoise = false;            // Run the guided denoiser on the image before writing it
+    bool    fast_math = RT_FAST_MATH_DEFAULT;   // Polynomial acos/atan2/sin/cos while shading (fast_math.h)
+    denoise_settings denoiser;          // Denoiser parameters, tune per scene
+
+    std::string output_file;            // Beauty image (ppm) file, stdout if empty
+
+    // Budget mode : when either is set, samples are added in passes until the budget (or 
+    // samples_per_pixel, now an upper limit) runs out, and the image is written with whatever 
+    // each pixel got. Its sample count AOV is always written.
+    double   time_budget    = 0;        // Wall clock seconds for the whole render, 0 : no limit
+    uint64_t ray_budget     = 0;        // Camera, bounce and shadow rays, 0 : no limit
+    double   budget_reserve = 0.05;     // Part of time_budget kept for denoising and writing, at least
+                                        // (raised to the measured time when that is longer)
 
-    Render_mode render_mode = Render_mode::NORMAL;
+    // Progressive preview : when set, the image is rendered in passes (coarse blocks, then 
+    // full resolution, then more samples) and each pass is published to this memory-mapped
+    // file for a viewer. (preview.h)
+    std::string preview_file;
+    int     preview_block = 16;         // Block edge of the first pass in pixels, a power of two
+
+    // Extra outputs rendered in the same pass as the beauty image.
+    // Each one is written to "<aov_prefix>_<name>.pfm".
+    std::vector<Aov> aovs;
+    std::string aov_prefix = "aov";
+    int     ao_samples  = 8;            // Occlusion rays per camera sample for Aov::AMBIENT_OCCLUSION
+    double  ao_distance = 1.0;          // Occluders farther than this from the hit point don't count
+
+    // Measured by the last render(), for benchmarks.
+    uint64_t last_render_rays = 0;      // Camera, bounce and shadow rays traced
+    double   last_render_seconds = 0;   // Wall clock time spent tracing them
 
     void render(const hittable& world)
     {
-        // calls init first
-        initialize();
+        render_image(world, nullptr);
+    }
+
+    void render(const hittable& world, const hittable& lights)
+    {
+        // "lights" holds the emissive objects (also part of "world") that are sampled
+        // explicitly at every diffuse or rough bounce. (next-event estimation)
+        render_image(world, &lights);
+    }
+
+    static void render_views(std::vector<camera>& views, const hittable& world, const hittable* lights = nullptr)
+    {
+        // Renders several views of one world, e.g. the cameras of a rig (camera_rig.h). The 
+        // world, its textures and BVH are shared, the tiles of all views are scheduled on the
+        // first view's thread pool, and each view writes its own output_file and AOVs.
+        // Views in budget or preview mode are rendered on their own after the others, their
+        // passes are sized for a single image.
+        if(views.empty()) return;
+        views[0].workers();
+
+        std::vector<camera*> batch;
+        for(size_t k = 0; k < views.size(); k++)
+        {
+            camera& view = views[k];
+            view.pool = views[0].pool;
+            // Band writers run side by side, so only one view can stream to stdout.
+            if(view.output_file.empty() && views.size() > 1)
+                view.output_file = "view_" + std::to_string(k) + ".ppm";
+            if(view.time_budget == 0 && view.ray_budget == 0 && view.preview_file.empty())
+                batch.push_back(&view);
+        }
+
+        if(!batch.empty()) render_tiles(batch, world, lights);
+        for(auto& view : views)
+            if(std::find(batch.begin(), batch.end(), &view) == batch.end())
+                view.render_image(world, lights);
+    }
+
+    /* Building blocks for renders split into jobs (distributed and progressive rendering) */
+
+    void initialize()
+    {
+        // Derives the image size and viewing frame from the settings above.
+        // render() calls it, job based renders call it once before their jobs.
+        setup_view();
+    }
+
+    int height() const { return image_height; }
+
+    void share_thread_pool(shared_ptr<thread_pool> shared)
+    {
+        // Renders with a pool owned by someone else (e.g. the render server) instead of
+        // creating one per camera.
+        pool = shared;
+    }
+
+    framebuffer render_job(
+        const hittable& world, const hittable* lights, const render_job_desc& job,
+        const std::function<bool()>& stop = nullptr, uint64_t* rays = nullptr
+    )
+    {
+        // Renders samples [sample_begin, sample_end) of the job's pixels into a framebuffer 
+        // of the job's size. Samplers are deterministic per (pixel, sample), so merging all
+        // jobs of an image gives the same image as rendering it in one go.
+        // Tiles that haven't started when "stop" returns true are skipped and keep a sample
+        // count of 0, so merging a stopped job only adds what was actually rendered.
+        // "rays", if given, receives the number of rays traced.
+        framebuffer part(job.x1 - job.x0, job.y1 - job.y0);
+        this->lights = lights;
+        select_kernel(world);
+        texture_loads::global().wait();
+
+        // Split the job into tiles for the thread pool.
+        int tiles_x = (part.width + tile_size - 1) / tile_size;
+        int tiles_y = (part.height + tile_size - 1) / tile_size;
+        auto pixel_sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+        std::atomic<uint64_t> job_rays(0);
+
+        workers().parallel_for(tiles_x * tiles_y, [&](int tile)
+        {
+            if(stop && stop()) return;
+
+            // Samplers keep per-sample state, so each tile works on its own copy.
+            auto tile_sampler = pixel_sampler->clone();
+            render_job_desc sub = job;
+            sub.x0 = job.x0 + (tile % tiles_x) * tile_size;
+            sub.y0 = job.y0 + (tile / tiles_x) * tile_size;
+            sub.x1 = std::min(sub.x0 + tile_size, job.x1);
+            sub.y1 = std::min(sub.y0 + tile_size, job.y1);
+
+            auto rays_before = traced_rays();
+            render_pixels(local_world(world), part, job.x0, job.y0, sub, *tile_sampler);
+            job_rays += traced_rays() - rays_before;
+        });
+
+        if(rays) *rays = job_rays;
+        return part;
+    }
+
+    void postprocess(framebuffer& fb)
+    {
+        // Post processing of a finished image, before it's written.
+        if(denoise) ::denoise(fb, denoiser, workers());
+    }
+
+    void write_output(framebuffer& fb)
+    {
+        // Post processing and output of a finished image.
+        postprocess(fb);
 
         // Writes ppm file (Render) (by '>' redirection in terminal)
-        // Render
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        if(output_file.empty()) fb.write_ppm(std::cout);
+        else
+        {
+            std::ofstream out(output_file, std::ios::binary);
+            fb.write_ppm(out);
+            if(out) std::clog << "Wrote " << output_file << '\n';
+        }
+
+        write_aovs(fb);
+    }
 
-        for(int j = 0; j < image_height; j++)
+    void write_aovs(const framebuffer& fb) const
+    {
+        for(auto aov : aovs)
         {
-            // \r is for CR
-            std::clog << "\rScanlines remaining: " << (image_height-j) << ' ' << std::flush;
-            for(int i = 0; i < image_width; i++)
-            {
-                color pixel_color(0,0,0);
-                for(int sample = 0; sample < samples_per_pixel; sample++)
-                {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
-                }
-                write_color(std::cout, pixel_samples_scale * pixel_color);
-            }
+            auto filename = aov_prefix + "_" + aov_name(aov) + ".pfm";
+            if(fb.write_pfm(filename, aov)) std::clog << "Wrote " << filename << '\n';
         }
-        std::clog << "\rDone.                   \n";
     }
     
 private:
     int     image_height;           // Desired & Rendered image heigth
-    double  pixel_samples_scale;    // Color scale factor for a sum of pixel samples
     point3  center;                 // Camera center
     point3  pixel00_loc;            // Location of pixel 0,0
     vec3    pixel_delta_u;          // Offset to right pixel
@@ -67,15 +226,573 @@ private:
     vec3    defocus_disk_u;         // Defocus disk horizontal radius.
     vec3    defocus_disk_v;         // Defocus disk vertical radius. (basis)
 
+    const hittable* lights = nullptr;   // Explicitly sampled lights, none if null
+    bool    ambient_occlusion = false;  // Aov::AMBIENT_OCCLUSION is rendered (set by select_kernel)
 
-    void initialize()
+    struct render_budget;
+    render_budget* budget = nullptr;    // Limits of the budgeted render in progress, if any
+
+    // Pixel loop specialized for the render's features (see select_kernel).
+    typedef void (camera::*pixel_kernel)(
+        const hittable&, framebuffer&, int, int, const render_job_desc&, sampler&) const;
+    pixel_kernel kernel = nullptr;
+
+    shared_ptr<thread_pool> pool;   // Created on first use and kept for later renders
+
+    thread_pool& workers()
+    {
+        if(!pool) pool = make_shared<thread_pool>(threads, pin_threads);
+        return *pool;
+    }
+
+    const hittable& local_world(const hittable& world) const
+    {
+        // The calling thread's node copy of world, if there is one.
+        if(node_worlds.empty() || node_worlds[0] != &world) return world;
+        int node = thread_pool::current_node();
+        return node < int(node_worlds.size()) ? *node_worlds[node] : world;
+    }
+
+    void render_image(const hittable& world, const hittable* lights)
+    {
+        if(time_budget > 0 || ray_budget > 0)
+        {
+            render_budgeted(world, lights);
+            return;
+        }
+        if(!preview_file.empty())
+        {
+            render_progressive(world, lights);
+            return;
+        }
+
+        render_tiles(std::vector<camera*>(1, this), world, lights);
+    }
+
+    static void render_tiles(const std::vector<camera*>& views, const hittable& world, const hittable* lights)
+    {
+        // Renders each view into a linear framebuffer, tile by tile across the first view's
+        // thread pool. The tiles of all views go to one parallel_for, so the pool doesn't 
+        // drain at the end of every image.
+        struct view_render
+        {
+            camera* cam;
+            framebuffer fb;
+            shared_ptr<sampler> pixel_sampler;
+            int tiles_x = 0;
+            int first_tile = 0;     // Index of the view's first tile in the batch
+            std::atomic<uint64_t> rays{0};
+            std::ofstream file;
+            std::unique_ptr<ppm_band_writer> writer;
+        };
+
+        camera& first = *views[0];
+        thread_pool& workers = first.workers();
+        std::vector<std::unique_ptr<view_render>> renders;
+        int total_tiles = 0;
+        for(auto cam : views)
+        {
+            // calls init first
+            cam->initialize();
+            cam->lights = lights;
+            cam->select_kernel(world);
+            cam->pool = first.pool;
+
+            std::unique_ptr<view_render> view(new view_render);
+            view->cam = cam;
+            view->fb = framebuffer(cam->image_width, cam->image_height);
+            view->pixel_sampler = make_sampler(cam->sampler_type, cam->samples_per_pixel, cam->seed);
+            view->tiles_x = (cam->image_width + cam->tile_size - 1) / cam->tile_size;
+            int tiles_y = (cam->image_height + cam->tile_size - 1) / cam->tile_size;
+            view->first_tile = total_tiles;
+            total_tiles += view->tiles_x * tiles_y;
+
+            // Without post processing the beauty image is final as soon as its tiles are, so 
+            // each row of tiles is encoded and written while the rows below it still render.
+            if(!cam->denoise)
+            {
+                if(!cam->output_file.empty()) view->file.open(cam->output_file, std::ios::binary);
+                view->writer.reset(new ppm_band_writer(
+                    view->fb, cam->output_file.empty() ? std::cout : view->file, cam->tile_size, view->tiles_x));
+            }
+            renders.push_back(std::move(view));
+        }
+
+        std::atomic<int> tiles_remaining(total_tiles);
+        std::atomic<uint64_t> rays(0);
+        std::vector<std::atomic<uint64_t>> node_rays(workers.node_count());
+        for(auto& count : node_rays) count = 0;
+        std::mutex log_mutex;
+        auto start = std::chrono::steady_clock::now();
+
+        // Tiles that saw an image texture still loading in the background. (texture_loads)
+        std::vector<int> deferred;
+
+        auto render_tile = [&](int tile)
+        {
+            // The tile's view is the last one starting at or before it.
+            size_t v = renders.size() - 1;
+            while(renders[v]->first_tile > tile) v--;
+            view_render& view = *renders[v];
+            const camera& cam = *view.cam;
+            int view_tile = tile - view.first_tile;
+
+            // Samplers keep per-sample state, so each tile works on its own copy.
+            auto tile_sampler = view.pixel_sampler->clone();
+            render_job_desc job;
+            job.x0 = (view_tile % view.tiles_x) * cam.tile_size;
+            job.y0 = (view_tile / view.tiles_x) * cam.tile_size;
+            job.x1 = std::min(job.x0 + cam.tile_size, cam.image_width);
+            job.y1 = std::min(job.y0 + cam.tile_size, cam.image_height);
+            job.sample_begin = 0;
+            job.sample_end = cam.samples_per_pixel;
+
+            texture_pending() = false;
+            auto rays_before = traced_rays();
+            cam.render_pixels(cam.local_world(world), view.fb, 0, 0, job, *tile_sampler);
+            auto tile_rays = traced_rays() - rays_before;
+            rays += tile_rays;
+            view.rays += tile_rays;
+            node_rays[thread_pool::current_node()] += tile_rays;
+
+            std::lock_guard<std::mutex> lock(log_mutex);
+            if(texture_pending())
+            {
+                deferred.push_back(tile);
+                return;
+            }
+            if(view.writer) view.writer->tile_done(view_tile / view.tiles_x);
+
+            int remaining = --tiles_remaining;
+            // \r is for CR
+            std::clog << "\rTiles remaining: " << remaining << ' ' << std::flush;
+        };
+        workers.parallel_for(total_tiles, render_tile);
+
+        if(!deferred.empty())
+        {
+            // Rendered again once the loads are done. Samples are deterministic per pixel and
+            // sample, so the image is the same as if the textures had been there from the start.
+            texture_loads::global().wait();
+            std::vector<int> tiles;
+            tiles.swap(deferred);
+            std::sort(tiles.begin(), tiles.end());
+            workers.parallel_for(int(tiles.size()), [&](int k) { render_tile(tiles[k]); });
+        }
+        std::chrono::duration<double> trace_time = std::chrono::steady_clock::now() - start;
+        std::clog << "\rDone. " << rays << " rays in " << trace_time.count() << "s, " 
+                  << rays / trace_time.count() / 1e6 << " Mrays/s\n";
+        if(node_rays.size() > 1)
+        {
+            // Per socket throughput, to see how evenly the nodes scale
+            for(size_t n = 0; n < node_rays.size(); n++)
+                std::clog << "  node " << n << " : " << workers.threads_on_node(int(n)) << " threads, "
+                          << node_rays[n] / trace_time.count() / 1e6 << " Mrays/s\n";
+        }
+        if(renders.size() > 1)
+        {
+            for(size_t v = 0; v < renders.size(); v++)
+                std::clog << "  view " << v << " : " << renders[v]->rays << " rays\n";
+        }
+
+        for(auto& view : renders)
+        {
+            camera& cam = *view->cam;
+            cam.last_render_rays = view->rays;
+            cam.last_render_seconds = trace_time.count();
+
+            if(!view->writer)
+            {
+                cam.write_output(view->fb);
+                continue;
+            }
+            view->writer->finish();
+            if(view->file.is_open() && view->file) std::clog << "Wrote " << cam.output_file << '\n';
+            cam.write_aovs(view->fb);
+        }
+    }
+
+    void render_progressive(const hittable& world, const hittable* lights)
+    {
+        // Same image as render_image, but built in passes with a preview after each one,
+        // so a bad camera setup is visible within the first fraction of a second.
+        initialize();
+        texture_loads::global().wait();
+        this->lights = lights;
+        select_kernel(world);
+
+        framebuffer fb(image_width, image_height);
+        preview_publisher preview(preview_file, image_width, image_height, samples_per_pixel);
+        auto pixel_sampler = make_sampler(sampler_type, samples_per_pixel, seed);
+        auto pass_start = std::chrono::steady_clock::now();
+
+        auto log_pass = [&](int block, int samples)
+        {
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - pass_start;
+            std::clog << "\rPreview : block " << block << ", " << samples << " spp, " 
+                      << elapsed.count() << "s      " << std::flush;
+        };
+
+        // Coarse passes : sample 0 of the first pixel of every block, halving the block size 
+        // each pass. Pixels done by a coarser pass are skipped, so when the block size reaches
+        // 1 every pixel has been rendered exactly once.
+        int first_block = 1;
+        while(first_block * 2 <= preview_block) first_block *= 2;
+
+        for(int block = first_block; block >= 1; block /= 2)
+        {
+            int rows = (image_height + block - 1) / block;
+            workers().parallel_for(rows, [&](int row)
+            {
+                auto row_sampler = pixel_sampler->clone();
+                render_job_desc job;
+                job.y0 = row * block;
+                job.y1 = job.y0 + 1;
+                job.sample_begin = 0;
+                job.sample_end = 1;
+
+                for(int i = 0; i < image_width; i += block)
+                {
+                    bool done_before = block < first_block && i % (2*block) == 0 && job.y0 % (2*block) == 0;
+                    if(done_before) continue;
+
+                    job.x0 = i;
+                    job.x1 = i + 1;
+                    render_pixels(local_world(world), fb, 0, 0, job, *row_sampler);
+                }
+            });
+            preview.publish(fb, block, block == 1 ? 1 : 0);
+            log_pass(block, 1);
+        }
+
+        // Sample passes : double the sample count each pass. Samplers are deterministic per
+        // (pixel, sample), so the final image matches a render without preview.
+        int samples = 1;
+        while(samples < samples_per_pixel)
+        {
+            render_job_desc job;
+            job.x1 = image_width;
+            job.y1 = image_height;
+            job.sample_begin = samples;
+            job.sample_end = std::min(2 * samples, samples_per_pixel);
+
+            fb.merge(render_job(world, lights, job), 0, 0);
+            samples = job.sample_end;
+            preview.publish(fb, 1, samples);
+            log_pass(1, samples);
+        }
+        std::clog << "\nDone.\n";
+
+        // The last publish shows the image as written, after denoising.
+        write_output(fb);
+        preview.publish(fb, 1, samples, true);
+    }
+
+    void render_budgeted(const hittable& world, const hittable* lights)
+    {
+        // Progressive sample passes, each sized from the measured throughput to fit what's
+        // left of the budget. The pixel kernels also check both limits before every sample
+        // (render_budget), so a pass that still runs late stops within a sample of the deadline
+        // or the last ray; its pixels just end up with fewer samples. The time for denoising
+        // and writing is measured on a crop after the first pass and kept out of the tracing.
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+        initialize();
+
+        auto seconds_since_start = [&]() 
+        { 
+            return std::chrono::duration<double>(clock::now() - start).count(); 
+        };
+        double trace_time = time_budget * (1 - budget_reserve);
+        auto out_of_time = [&]() { return time_budget > 0 && seconds_since_start() >= trace_time; };
+
+        render_budget limits;
+        limits.ray_limit = ray_budget;
+        limits.has_deadline = time_budget > 0;
+        limits.deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(trace_time));
+        budget = &limits;
+        bool finish_measured = false;
+
+        framebuffer fb(image_width, image_height);
+        std::unique_ptr<preview_publisher> preview;
+        if(!preview_file.empty())
+            preview.reset(new preview_publisher(preview_file, image_width, image_height, samples_per_pixel));
+
+        int samples = 0;            // Samples every pixel got from finished passes
+        int passes = 0;
+        uint64_t total_rays = 0;
+        double seconds_per_sample = 0;  // Whole image, one sample per pixel
+        double rays_per_sample = 0;
+
+        while(samples < samples_per_pixel)
+        {
+            // Size the pass : at most double the samples so far (the image keeps refining 
+            // evenly), at most what the remaining time and rays are predicted to allow.
+            int pass_samples = std::max(1, samples);
+            if(time_budget > 0 && seconds_per_sample > 0)
+            {
+                // Less than a whole pass left still gets a 1 spp pass, cut off at the deadline,
+                // so the time goes to some pixels rather than to none.
+                auto left = trace_time - seconds_since_start();
+                pass_samples = std::max(1, std::min(pass_samples, int(left / seconds_per_sample)));
+            }
+            if(ray_budget > 0 && rays_per_sample > 0)
+            {
+                // Like the time, the rest of a whole pass goes to some pixels. (cut off by the
+                // kernels at the last ray)
+                auto left = double(ray_budget - std::min(ray_budget, total_rays));
+                pass_samples = std::max(1, std::min(pass_samples, int(left / rays_per_sample)));
+            }
+            pass_samples = std::min(pass_samples, samples_per_pixel - samples);
+            if(pass_samples < 1 || out_of_time() || limits.exhausted) break;
+
+            render_job_desc job;
+            job.x1 = image_width;
+            job.y1 = image_height;
+            job.sample_begin = samples;
+            job.sample_end = samples + pass_samples;
+
+            auto pass_start = clock::now();
+            uint64_t pass_rays = 0;
+            auto stop = [&]() { return out_of_time(); };
+            auto part = render_job(world, lights, job, stop, &pass_rays);
+            std::chrono::duration<double> pass_time = clock::now() - pass_start;
+            fb.merge(part, 0, 0);
+
+            total_rays += pass_rays;
+            passes++;
+            if(limits.exhausted) break;     // Cut short, some pixels have fewer samples
+
+            samples = job.sample_end;
+            seconds_per_sample = pass_time.count() / pass_samples;
+            rays_per_sample = double(pass_rays) / pass_samples;
+            if(preview) preview->publish(fb, 1, samples);
+
+            if(time_budget > 0 && !finish_measured)
+            {
+                // Keep the post processing and output time out of the tracing time, when it's
+                // more than the fixed reserve.
+                finish_measured = true;
+                trace_time = std::min(trace_time, time_budget - finish_seconds());
+                limits.deadline = start + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(trace_time));
+            }
+
+            std::clog << "\rBudget : " << samples << " spp, " << seconds_since_start() << "s, " 
+                      << total_rays << " rays      " << std::flush;
+        }
+
+        // Report what each pixel achieved.
+        int min_samples = samples_per_pixel, max_samples = 0;
+        double sum_samples = 0;
+        for(auto count : fb.sample_count)
+        {
+            min_samples = std::min(min_samples, count);
+            max_samples = std::max(max_samples, count);
+            sum_samples += count;
+        }
+        auto elapsed = seconds_since_start();
+        std::clog << "\nBudget render : " << passes << " passes, samples per pixel min " << min_samples 
+                  << " / mean " << sum_samples / fb.sample_count.size() << " / max " << max_samples
+                  << ", " << total_rays << " rays in " << elapsed << "s ("
+                  << (elapsed > 0 ? total_rays / elapsed / 1e6 : 0) << " Mrays/s)\n";
+        last_render_rays = total_rays;
+        last_render_seconds = elapsed;
+        budget = nullptr;
+
+        if(std::find(aovs.begin(), aovs.end(), Aov::SAMPLE_COUNT) == aovs.end())
+            aovs.push_back(Aov::SAMPLE_COUNT);
+        write_output(fb);
+        if(preview) preview->publish(fb, 1, samples, true);
+
+        if(time_budget > 0)
+            std::clog << "Finished after " << seconds_since_start() << "s of a " << time_budget << "s budget.\n";
+    }
+
+    double finish_seconds()
+    {
+        // Time write_output will take, estimated from denoising and encoding a crop of the
+        // image (both are linear in the pixel count, whatever the pixels hold), with a 2x margin.
+        using clock = std::chrono::steady_clock;
+        framebuffer crop(std::min(image_width, 64), std::min(image_height, 64));
+        auto finish_start = clock::now();
+        postprocess(crop);
+        std::ostringstream out;
+        crop.write_ppm(out);
+        for(size_t k = 0; k <= aovs.size(); k++) crop.write_pfm(out, Aov::SAMPLE_COUNT);
+        std::chrono::duration<double> crop_time = clock::now() - finish_start;
+
+        double scale = double(image_width) * image_height / (double(crop.width) * crop.height);
+        return 2 * scale * crop_time.count();
+    }
+
+    // Limits of a budgeted render, checked by the pixel kernels before every sample.
+    struct render_budget
+    {
+        std::atomic<uint64_t> rays{0};      // Rays of all threads, each adds its own at its checks
+        uint64_t ray_limit = 0;             // 0 : no limit
+        bool has_deadline = false;
+        std::chrono::steady_clock::time_point deadline;
+        std::atomic<bool> exhausted{false}; // Set by the first thread to find a limit reached
+    };
+
+    bool out_of_budget(uint64_t& counted) const
+    {
+        // Adds the calling thread's rays since its last check ("counted" : traced_rays() then)
+        // to the shared count and tests both limits.
+        if(budget->exhausted.load(std::memory_order_relaxed)) return true;
+        auto now_rays = traced_rays();
+        uint64_t total = budget->rays += now_rays - counted;
+        counted = now_rays;
+        bool out = (budget->ray_limit > 0 && total >= budget->ray_limit)
+                || (budget->has_deadline && std::chrono::steady_clock::now() >= budget->deadline);
+        if(out) budget->exhausted = true;
+        return out;
+    }
+
+    static uint64_t& traced_rays()
+    {
+        // Rays traced by the calling thread, counted per thread to keep it off the hot path.
+        static thread_local uint64_t count = 0;
+        return count;
+    }
+
+    void select_kernel(const hittable& world)
+    {
+        // Features a render doesn't use are compiled out of its pixel loop instead of being
+        // tested per sample : the lens draw for pinholes, the ray time for static scenes,
+        // the first hit guides when no AOV or denoiser reads them, and light sampling (MIS
+        // and shadow rays) without lights. Chosen once per render, after "lights" is set.
+        bool defocus = defocus_angle > 0;
+        bool motion = world.is_moving();
+        bool guides = denoise;
+        for(auto aov : aovs)
+            if(aov != Aov::BEAUTY && aov != Aov::SAMPLE_COUNT) guides = true;
+        bool light_sampling = lights != nullptr;
+        ambient_occlusion = ao_samples > 0 
+            && std::find(aovs.begin(), aovs.end(), Aov::AMBIENT_OCCLUSION) != aovs.end();
+
+        kernel = pick_kernel(defocus, motion, guides, light_sampling);
+    }
+
+    // Turns the runtime flags into template arguments, one at a time.
+    static pixel_kernel pick_kernel(bool defocus, bool motion, bool guides, bool light_sampling)
+    {
+        return defocus ? pick_kernel<true>(motion, guides, light_sampling) 
+                       : pick_kernel<false>(motion, guides, light_sampling);
+    }
+
+    template <bool Defocus>
+    static pixel_kernel pick_kernel(bool motion, bool guides, bool light_sampling)
+    {
+        return motion ? pick_kernel<Defocus, true>(guides, light_sampling) 
+                      : pick_kernel<Defocus, false>(guides, light_sampling);
+    }
+
+    template <bool Defocus, bool Motion>
+    static pixel_kernel pick_kernel(bool guides, bool light_sampling)
+    {
+        return guides ? pick_kernel<Defocus, Motion, true>(light_sampling) 
+                      : pick_kernel<Defocus, Motion, false>(light_sampling);
+    }
+
+    template <bool Defocus, bool Motion, bool Guides>
+    static pixel_kernel pick_kernel(bool light_sampling)
+    {
+        return light_sampling ? &camera::render_kernel<Defocus, Motion, Guides, true>
+                              : &camera::render_kernel<Defocus, Motion, Guides, false>;
+    }
+
+    void render_pixels(
+        const hittable& world, framebuffer& fb, int fb_x0, int fb_y0, const render_job_desc& job, 
+        sampler& smp
+    ) const
+    {
+        // Renders the job's pixels and samples, with their first hit guides. Image pixel (i, j)
+        // is stored at (i - fb_x0, j - fb_y0) in fb.
+        // The math mode isn't a kernel parameter (it's read below the virtual hit calls), it's
+        // set for this thread, which may have rendered another camera's pixels before.
+        fast_math_enabled() = fast_math;
+        (this->*kernel)(world, fb, fb_x0, fb_y0, job, smp);
+    }
+
+    template <bool Defocus, bool Motion, bool Guides, bool Lights>
+    void render_kernel(
+        const hittable& world, framebuffer& fb, int fb_x0, int fb_y0, const render_job_desc& job, 
+        sampler& smp
+    ) const
+    {
+        uint64_t budget_counted = traced_rays();
+
+        for(int j = job.y0; j < job.y1; j++)
+        {
+            for(int i = job.x0; i < job.x1; i++)
+            {
+                std::chrono::steady_clock::time_point pixel_start;
+                if(Guides) pixel_start = std::chrono::steady_clock::now();
+
+                color pixel_color(0,0,0);
+                color albedo(0,0,0);
+                vec3 normal(0,0,0);
+                double depth = 0;
+                int depth_hits = 0;
+                uint32_t object_id = 0;
+                double occlusion = 0;
+
+                int sample = job.sample_begin;
+                for(; sample < job.sample_end; sample++)
+                {
+                    if(budget && out_of_budget(budget_counted)) break;
+
+                    smp.start_pixel_sample(i, j, sample);
+                    ray r = get_ray<Defocus, Motion>(i, j, smp);
+
+                    if(!Guides)
+                    {
+                        pixel_color += ray_color<false, Lights>(r, max_depth, world, smp, 0, nullptr);
+                        continue;
+                    }
+
+                    sample_guides guides;
+                    pixel_color += ray_color<true, Lights>(r, max_depth, world, smp, 0, &guides);
+
+                    if(sample == job.sample_begin) object_id = guides.object_id;
+                    albedo += guides.albedo;
+                    normal += guides.normal;
+                    occlusion += guides.occlusion;
+                    if(guides.depth > 0)
+                    {
+                        depth += guides.depth;
+                        depth_hits++;
+                    }
+                }
+
+                // The pixel saw a texture still loading, its tile is rendered again later.
+                if(texture_pending()) return;
+                // Out of budget before its first sample, the pixel keeps a sample count of 0.
+                if(sample == job.sample_begin) continue;
+
+                auto pixel_samples_scale = 1.0 / (sample - job.sample_begin);
+                auto p = fb.index(i - fb_x0, j - fb_y0);
+                fb.beauty[p] = pixel_samples_scale * pixel_color;
+                fb.sample_count[p] = sample - job.sample_begin;
+                if(!Guides) continue;
+
+                fb.albedo[p] = pixel_samples_scale * albedo;
+                fb.normal[p] = pixel_samples_scale * normal;
+                fb.depth[p] = depth_hits > 0 ? depth / depth_hits : 0;
+                fb.object_id[p] = object_id;
+                fb.occlusion[p] = pixel_samples_scale * occlusion;
+                fb.time[p] = std::chrono::duration<float>(std::chrono::steady_clock::now() - pixel_start).count();
+            }
+        }
+    }
+
+    void setup_view()
     {
         // Caculate the image height, and ensure that it's at least 1
         image_height = static_cast<int>(image_width / aspect_ratio);
         image_height = (image_height < 1) ? 1 : image_height;
 
-        pixel_samples_scale = 1.0 / samples_per_pixel;
-
         center = lookfrom;
 
         // Determin viewport dimensions.
@@ -116,71 +833,185 @@ private:
         defocus_disk_v = v * defocus_radius;
     }
 
-    color ray_color(const ray& r, int depth, const hittable& world) const
+    template <bool Guides, bool Lights>
+    color ray_color(
+        const ray& r, int depth, const hittable& world, sampler& smp, double scatter_pdf,
+        sample_guides* guides
+    ) const
     {
+        // scatter_pdf : solid angle density with which the previous bounce sampled "r".
+        // 0 for camera rays and delta (mirror, glass) bounces, whose emission isn't shared 
+        // with light sampling.
+        // Guides : record the first hit into "guides". Lights : sample "lights" (non null).
         // If we've exceeded the ray bounce limit, no more light is gathered.
         if(depth <= 0) return color(0,0,0);
         
         hit_record rec;
+        traced_rays()++;
         
-        if(render_mode == Render_mode::NORMAL && world.hit(r, interval(0, infinity), rec))
-        {
-            // 0.5 is for normalizing ([-1,1] normal range to [0,1] color range)
-            return 0.5 * (rec.normal + color(1,1,1));
-        }
         // set ray_tmin=0.001 to solve shadow acne problem
-        else if(render_mode == Render_mode::MATERIAL && world.hit(r, interval(0.001, infinity), rec))
+        if(world.hit(r, interval(0.001, infinity), rec))
         {
+            const material_data& mat = *rec.mat;
+            color radiance = material_emitted(mat, rec);
+
+            if(Guides) record_guides(*guides, r, rec, material_albedo(mat, rec));
+
+            // A light that was also reachable by light sampling at the previous bounce
+            // is weighted against it (multiple importance sampling).
+            if(Lights && scatter_pdf > 0 && !radiance.near_zero())
+                radiance *= power_heuristic(scatter_pdf, lights->pdf_value(r.origin(), r.direction()));
+
+            // Every bounce draws the same dimensions whether it uses them or not,
+            // so each sampler dimension always feeds the same decision.
+            // (the light sample dimensions only exist in kernels that sample lights)
+            auto xi = smp.get_scatter();
+            double light_u1 = 0, light_u2 = 0;
+            if(Lights) smp.get_2d(light_u1, light_u2);
+
+            // Direct light doesn't depend on the BSDF sample, so it's added even when that
+            // sample fails (a fuzzed reflection below the surface).
+            bool samples_lights = Lights && material_samples_lights(mat);
+            if(samples_lights) radiance += sample_lights(r, rec, world, light_u1, light_u2);
+
             // out params
             ray scattered;
             color attenuation;
 
-            if(rec.mat->scatter(r, rec, attenuation, scattered))
-                return attenuation * ray_color(scattered, depth-1, world);
-            return color(0,0,0);
+            if(!material_scatter(mat, r, rec, attenuation, scattered, xi))
+            {
+                if(Guides && ambient_occlusion) guides->occlusion = occlusion_at(r, rec, world, smp);
+                return radiance;
+            }
+
+            double pdf = samples_lights ? material_pdf(mat, r, rec, scattered.direction()) : 0;
+
+            color result = radiance + attenuation * ray_color<false, Lights>(scattered, depth-1, world, smp, pdf, nullptr);
+
+            // Drawn after the whole path, so the path's sampler dimensions don't depend on
+            // whether ambient occlusion is rendered.
+            if(Guides && ambient_occlusion) guides->occlusion = occlusion_at(r, rec, world, smp);
+            return result;
+        }
+
+        color sky = background;
+        if(sky_gradient)
+        {
+            // linear interpolation (lerp) of white to skyblue color along the y height
+            vec3 unit_direction = unit_vector(r.direction());
+            // y element is in (-1,1)
+            // then +1 to (0,2) and *0.5 to (0,1)
+            auto a = 0.5*(unit_direction.y()+1.0f);
+            // blended value = (1-a) * start value + a * end value
+            sky = (1.0-a)*color(1.0,1.0,1.0) + a*color(0.5,0.7,1.0);
+        }
+
+        // Misses keep the background as albedo so the denoiser treats the sky as one surface.
+        if(Guides) guides->albedo = sky;
+        return sky;
+    }
+
+    static void record_guides(sample_guides& guides, const ray& r, const hit_record& rec, const color& albedo)
+    {
+        guides.albedo = albedo;
+        guides.normal = rec.normal;
+        guides.depth = rec.t * r.direction().length();
+        guides.object_id = rec.object_id;
+    }
+
+    double occlusion_at(const ray& r, const hit_record& rec, const hittable& world, sampler& smp) const
+    {
+        // Part of ao_samples cosine weighted directions around the shading normal that get
+        // ao_distance away from the hit point without hitting anything.
+        onb uvw(rec.normal);
+        int open = 0;
+        for(int k = 0; k < ao_samples; k++)
+        {
+            double u1, u2;
+            smp.get_2d(u1, u2);
+            ray probe(rec.p, uvw.transform(sample_cosine_hemisphere(u1, u2)), r.time());
+            traced_rays()++;
+            if(!world.occluded(probe, interval(0.001, ao_distance))) open++;
         }
+        return double(open) / ao_samples;
+    }
+
+    color sample_lights(
+        const ray& r_in, const hit_record& rec, const hittable& world, double u1, double u2
+    ) const
+    {
+        // Direct lighting from one light sample, MIS weighted against BSDF sampling.
+        vec3 direction = lights->random(rec.p, u1, u2);
+        auto light_pdf = lights->pdf_value(rec.p, direction);
+        if(light_pdf <= 0) return color(0,0,0);
 
-        // linear interpolation (lerp) of white to skyblue color along the y height
-        vec3 unit_direction = unit_vector(r.direction());
-        // y element is in (-1,1)
-        // then +1 to (0,2) and *0.5 to (0,1)
-        auto a = 0.5*(unit_direction.y()+1.0f);
-        // blended value = (1-a) * start value + a * end value
-        return (1.0-a)*color(1.0,1.0,1.0) + a*color(0.5,0.7,1.0);
+        color f = material_eval(*rec.mat, r_in, rec, direction);
+        if(f.near_zero()) return color(0,0,0);
+
+        // Shadow ray : the closest hit among the lights only, then a visibility query over
+        // the world for anything in front of it. (the light's own surface, at light_rec.t,
+        // is just outside the interval)
+        ray shadow(rec.p, direction, r_in.time());
+        hit_record light_rec;
+        traced_rays()++;
+        if(!lights->hit(shadow, interval(0.001, infinity), light_rec)) return color(0,0,0);
+        if(world.occluded(shadow, interval(0.001, light_rec.t * (1 - 1e-9)))) return color(0,0,0);
+
+        color emitted = material_emitted(*light_rec.mat, light_rec);
+        auto weight = power_heuristic(light_pdf, material_pdf(*rec.mat, r_in, rec, direction));
+        return f * emitted * (weight / light_pdf);
     }
 
-    ray get_ray(int i, int j) const
+    static double power_heuristic(double pdf_a, double pdf_b)
+    {
+        // Veach's power heuristic (beta = 2) weight for a sample taken with pdf_a.
+        auto a2 = pdf_a * pdf_a;
+        auto b2 = pdf_b * pdf_b;
+        return (a2 + b2) > 0 ? a2 / (a2 + b2) : 0;
+    }
+
+    template <bool Defocus, bool Motion>
+    ray get_ray(int i, int j, sampler& smp) const
     {
         // Construct a camera ray originating from the origin and directed at randomly sampled
         // point around the pixel location i, j.
 
-        auto offset = sample_square();
+        auto offset = sample_square(smp);
         auto pixel_sample = pixel00_loc
                           + ((i + offset.x()) * pixel_delta_u)
                           + ((j + offset.y()) * pixel_delta_v);
 
         // ray orignates randomly when defocus_angle is larger than 0.
         // defocus_angle = 0 can be thought as pinhole and no defocus blur
-        auto ray_origin = (defocus_angle <= 0) ? center : defocus_disk_sample();
+        // (Pinhole kernels don't draw the lens dimensions, static scenes don't draw a time.)
+        point3 ray_origin = center;
+        if(Defocus)
+        {
+            double lens_u1, lens_u2;
+            smp.get_2d(lens_u1, lens_u2);
+            ray_origin = defocus_disk_sample(lens_u1, lens_u2);
+        }
         auto ray_direction = pixel_sample - ray_origin;
-        auto ray_time = random_double();  // fire ray at [0,1) in 1 frame;
+        auto ray_time = Motion ? smp.get_1d() : 0.0;  // fire ray at [0,1) in 1 frame;
 
         return ray(ray_origin, ray_direction, ray_time);
     }
 
-    vec3 sample_square() const
+    vec3 sample_square(sampler& smp) const
     {
         // Returns the vector to a random point in the [-0.5, +0.5] unit square.
-        // random_double() is in range [0,1)
-        return vec3(random_double() - 0.5, random_double() - 0.5, 0);
+        // sampler values are in range [0,1)
+        double u1, u2;
+        smp.get_2d(u1, u2);
+        return vec3(u1 - 0.5, u2 - 0.5, 0);
     }
     // "sample_disk()" can be used alternativly, and can be found in official github repo.
 
 
-    point3 defocus_disk_sample() const
+    point3 defocus_disk_sample(double u1, double u2) const
     {
-        // Returns a random point in the camera defocus disk.
-        auto p = random_in_unit_disk();
+        // Returns a random point in the camera defocus disk. (concentric mapping)
+        auto p = sample_concentric_disk(u1, u2);
         return center + (p[0] * defocus_disk_u) + (p[1] * defocus_disk_v);
     }
 };
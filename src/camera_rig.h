@@ -0,0 +1,124 @@
+#ifndef CAMERA_RIG_H
+#define CAMERA_RIG_H
+
+// Named multi-view rigs : the cameras of a stereo pair, a cube map or a turntable, derived
+// from one base camera and rendered together over one build of the scene.
+// (camera::render_views)
+//
+//   stereo[:ipd=0.065]     Left and right eye, ipd apart along the camera's right vector,
+//                          with parallel view axes.
+//   cubemap                Six square 90 degree faces around lookfrom, for environment maps
+//                          and light probes. Faces px, nx, py, ny, pz, nz (+x, -x, ...), the
+//                          side faces with +y up, py with -z up and ny with +z up.
+//   turntable[:views=8]    Views evenly spaced around the vup axis through lookat, at the
+//                          distance and height of lookfrom.
+//
+// A view named "left" of a base camera writing "out.ppm" writes "out_left.ppm" (view_left.ppm
+// when the base writes to stdout), and its AOVs under "<aov_prefix>_left".
+
+#include "camera.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct rig_settings
+{
+    std::string name;       // stereo, cubemap or turntable
+    double      ipd   = 0.065;  // stereo : distance between the eyes, in scene units
+    int         views = 8;      // turntable : number of views around the full turn
+};
+
+// "turntable:views=12" -> settings, false for an unknown rig or parameter.
+inline bool parse_camera_rig(const std::string& spec, rig_settings& settings)
+{
+    auto colon = spec.find(':');
+    settings.name = spec.substr(0, colon);
+    if(settings.name != "stereo" && settings.name != "cubemap" && settings.name != "turntable")
+        return false;
+    if(colon == std::string::npos) return true;
+
+    std::istringstream in(spec.substr(colon + 1));
+    std::string item;
+    while(std::getline(in, item, ','))
+    {
+        auto eq = item.find('=');
+        if(eq == std::string::npos) return false;
+        auto key = item.substr(0, eq);
+        auto value = std::atof(item.substr(eq + 1).c_str());
+
+        if(key == "ipd" && settings.name == "stereo") settings.ipd = value;
+        else if(key == "views" && settings.name == "turntable" && value >= 1) settings.views = int(value);
+        else return false;
+    }
+    return true;
+}
+
+inline std::vector<camera> make_camera_rig(const rig_settings& rig, const camera& base)
+{
+    std::vector<camera> views;
+
+    std::string stem = base.output_file.empty() ? "view" : base.output_file;
+    if(stem.size() > 4 && stem.compare(stem.size() - 4, 4, ".ppm") == 0) stem.resize(stem.size() - 4);
+
+    auto add_view = [&](const std::string& name) -> camera&
+    {
+        views.push_back(base);
+        camera& view = views.back();
+        view.output_file = stem + "_" + name + ".ppm";
+        view.aov_prefix = base.aov_prefix + "_" + name;
+        return view;
+    };
+
+    if(rig.name == "stereo")
+    {
+        // Same right vector as camera::setup_view
+        vec3 right = unit_vector(cross(base.vup, base.lookfrom - base.lookat));
+        const char* names[2] = { "left", "right" };
+        for(int eye = 0; eye < 2; eye++)
+        {
+            camera& view = add_view(names[eye]);
+            vec3 offset = (eye == 0 ? -0.5 : 0.5) * rig.ipd * right;
+            view.lookfrom = base.lookfrom + offset;
+            view.lookat = base.lookat + offset;
+        }
+    }
+    else if(rig.name == "cubemap")
+    {
+        const char* names[6] = { "px", "nx", "py", "ny", "pz", "nz" };
+        const vec3 directions[6] = { vec3(1,0,0), vec3(-1,0,0), vec3(0,1,0), vec3(0,-1,0), vec3(0,0,1), vec3(0,0,-1) };
+        const vec3 ups[6] = { vec3(0,1,0), vec3(0,1,0), vec3(0,0,-1), vec3(0,0,1), vec3(0,1,0), vec3(0,1,0) };
+        for(int face = 0; face < 6; face++)
+        {
+            camera& view = add_view(names[face]);
+            view.lookat = base.lookfrom + directions[face];
+            view.vup = ups[face];
+            view.vfov = 90;
+            view.aspect_ratio = 1.0;
+            view.defocus_angle = 0;     // Faces have to meet at their edges
+        }
+    }
+    else if(rig.name == "turntable")
+    {
+        // Rotates lookfrom around the axis (Rodrigues' formula)
+        vec3 axis = unit_vector(base.vup);
+        vec3 offset = base.lookfrom - base.lookat;
+        for(int k = 0; k < rig.views; k++)
+        {
+            char name[16];
+            std::snprintf(name, sizeof(name), "%03d", k);
+            camera& view = add_view(name);
+
+            auto angle = 2 * pi * k / rig.views;
+            auto cos_angle = std::cos(angle);
+            auto sin_angle = std::sin(angle);
+            view.lookfrom = base.lookat + cos_angle * offset + sin_angle * cross(axis, offset)
+                          + (1 - cos_angle) * dot(axis, offset) * axis;
+        }
+    }
+    return views;
+}
+
+#endif
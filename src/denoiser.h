@@ -0,0 +1,127 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include "framebuffer.h"
+#include "thread_pool.h"
+
+// Edge avoiding a-trous wavelet denoiser. ("Edge-Avoiding A-Trous Wavelet Transform for
+// fast Global Illumination Filtering", Dammertz et al. 2010)
+//
+// Each iteration blurs with a 5x5 B3 spline kernel whose taps are spread 2^k pixels apart,
+// so a few cheap iterations cover a large footprint. Every tap is weighted down when its
+// guides (normal, albedo, depth) or its color differ from the center pixel, which keeps 
+// geometric and texture edges sharp.
+// The beauty image is divided by the albedo first and multiplied back afterwards, so only
+// the lighting gets blurred and textures keep their detail.
+
+struct denoise_settings
+{
+    int     iterations      = 5;    // Filter passes, footprint grows to (4 * 2^iterations + 1) pixels
+    double  sigma_color     = 1.0;  // Color (lighting) difference tolerance, halved every pass
+    double  sigma_normal    = 0.3;  // Normal difference tolerance
+    double  sigma_albedo    = 0.1;  // Albedo difference tolerance
+    double  sigma_depth     = 0.05; // Depth difference tolerance, relative to the center depth
+    int     tile_size       = 32;   // Tile edge in pixels for the parallel passes
+};
+
+inline void denoise(framebuffer& fb, const denoise_settings& settings, thread_pool& pool)
+{
+    const int width = fb.width;
+    const int height = fb.height;
+    const size_t pixel_count = size_t(width) * height;
+
+    // Demodulate : lighting = beauty / albedo
+    const double albedo_epsilon = 1e-3;
+    std::vector<color> lighting(pixel_count);
+    std::vector<color> filtered(pixel_count);
+    for(size_t p = 0; p < pixel_count; p++)
+    {
+        const color& a = fb.albedo[p];
+        lighting[p] = color(fb.beauty[p].x() / std::fmax(a.x(), albedo_epsilon),
+                            fb.beauty[p].y() / std::fmax(a.y(), albedo_epsilon),
+                            fb.beauty[p].z() / std::fmax(a.z(), albedo_epsilon));
+    }
+
+    static const double kernel[5] = { 1.0/16, 1.0/4, 3.0/8, 1.0/4, 1.0/16 };
+
+    const int tiles_x = (width + settings.tile_size - 1) / settings.tile_size;
+    const int tiles_y = (height + settings.tile_size - 1) / settings.tile_size;
+
+    for(int iteration = 0; iteration < settings.iterations; iteration++)
+    {
+        const int step = 1 << iteration;
+        const double sigma_color = settings.sigma_color / step;
+        const double inv_color  = 1.0 / (sigma_color * sigma_color);
+        const double inv_normal = 1.0 / (settings.sigma_normal * settings.sigma_normal);
+        const double inv_albedo = 1.0 / (settings.sigma_albedo * settings.sigma_albedo);
+
+        pool.parallel_for(tiles_x * tiles_y, [&](int tile)
+        {
+            const int x0 = (tile % tiles_x) * settings.tile_size;
+            const int y0 = (tile / tiles_x) * settings.tile_size;
+            const int x1 = std::min(x0 + settings.tile_size, width);
+            const int y1 = std::min(y0 + settings.tile_size, height);
+
+            for(int j = y0; j < y1; j++)
+            {
+                for(int i = x0; i < x1; i++)
+                {
+                    const size_t p = fb.index(i, j);
+                    const color& c_p = lighting[p];
+                    const vec3& n_p = fb.normal[p];
+                    const color& a_p = fb.albedo[p];
+                    const double z_p = fb.depth[p];
+
+                    color sum(0,0,0);
+                    double weight_sum = 0;
+
+                    for(int dy = -2; dy <= 2; dy++)
+                    {
+                        const int y = j + dy * step;
+                        if(y < 0 || y >= height) continue;
+
+                        for(int dx = -2; dx <= 2; dx++)
+                        {
+                            const int x = i + dx * step;
+                            if(x < 0 || x >= width) continue;
+
+                            const size_t q = fb.index(x, y);
+                            double exponent = 
+                                  (c_p - lighting[q]).length_squared() * inv_color
+                                + (n_p - fb.normal[q]).length_squared() * inv_normal
+                                + (a_p - fb.albedo[q]).length_squared() * inv_albedo;
+
+                            if(z_p > 0)
+                            {
+                                // Depth difference relative to the distance, so far away
+                                // surfaces aren't treated as edges everywhere.
+                                auto dz = std::fabs(z_p - fb.depth[q]) / (settings.sigma_depth * z_p);
+                                exponent += dz;
+                            }
+
+                            const double weight = kernel[dx+2] * kernel[dy+2] * std::exp(-exponent);
+                            sum += weight * lighting[q];
+                            weight_sum += weight;
+                        }
+                    }
+
+                    // The center tap always has weight kernel[2]^2 > 0.
+                    filtered[p] = sum / weight_sum;
+                }
+            }
+        });
+
+        lighting.swap(filtered);
+    }
+
+    // Remodulate with the albedo.
+    for(size_t p = 0; p < pixel_count; p++)
+    {
+        const color& a = fb.albedo[p];
+        fb.beauty[p] = color(lighting[p].x() * std::fmax(a.x(), albedo_epsilon),
+                             lighting[p].y() * std::fmax(a.y(), albedo_epsilon),
+                             lighting[p].z() * std::fmax(a.z(), albedo_epsilon));
+    }
+}
+
+#endif
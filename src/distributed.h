@@ -0,0 +1,599 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+// Distributed rendering over TCP.
+//
+// The coordinator builds the scene, splits the image into jobs (tiles, optionally further
+// split into sample slices) and listens for workers. Workers connect from any machine,
+// receive the scene name, build the same scene and then render one job at a time,
+// streaming each finished job back. The coordinator merges the results and writes the image.
+//
+//   coordinator : ./RTinOneWeekend <scene> --coordinator <port> [--spawn N] [--slices K]
+//   worker      : ./RTinOneWeekend --worker <host>:<port>
+//
+// Samplers are deterministic per (pixel, sample), so the merged image doesn't depend on
+// which worker rendered which job. A job whose worker disconnects goes back to the queue,
+// and a job that takes far too long is handed to an idle worker as well (first result wins).
+// "--spawn N" starts N local worker processes, which is also the easy way to test all this
+// on one machine.
+//
+// Messages are [u32 type][u32 payload length][payload], every number little endian.
+
+#include "scene.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+    #include <arpa/inet.h>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #include <poll.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <sys/types.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+struct coordinator_settings
+{
+    int     port            = 0;        // Listening port, 0 : any free port (printed)
+    int     spawn_workers   = 0;        // Local worker processes to start
+    int     job_size        = 64;       // Job tile edge in pixels
+    int     sample_slices   = 1;        // Split each tile's samples into this many jobs
+    double  job_timeout     = 60;       // Seconds before a running job is also given to an idle worker
+    double  worker_wait     = 60;       // Seconds to wait without any worker before giving up
+};
+
+namespace wire
+{
+    enum message_type : uint32_t
+    {
+        SCENE   = 1,    // coordinator -> worker : scene name
+        READY   = 2,    // worker -> coordinator : scene built, send jobs
+        JOB     = 3,    // coordinator -> worker : job id and render_job_desc
+        RESULT  = 4,    // worker -> coordinator : job id, size and pixels
+        BYE     = 5     // coordinator -> worker : no more jobs
+    };
+
+    inline void put_u32(std::vector<char>& out, uint32_t x)
+    {
+        for(int b = 0; b < 4; b++) out.push_back(char((x >> (8*b)) & 0xff));
+    }
+
+    inline void put_u64(std::vector<char>& out, uint64_t x)
+    {
+        for(int b = 0; b < 8; b++) out.push_back(char((x >> (8*b)) & 0xff));
+    }
+
+    inline void put_f64(std::vector<char>& out, double x)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &x, sizeof(bits));
+        put_u64(out, bits);
+    }
+
+    // Reads values back in the order they were put.
+    class reader
+    {
+    public:
+        reader(const char* data, size_t size) : data(data), size(size) {}
+
+        bool ok() const { return !overrun; }
+
+        uint32_t u32()
+        {
+            uint32_t x = 0;
+            if(!take(4)) return 0;
+            for(int b = 0; b < 4; b++) x |= uint32_t(uint8_t(data[pos - 4 + b])) << (8*b);
+            return x;
+        }
+
+        uint64_t u64()
+        {
+            uint64_t x = 0;
+            if(!take(8)) return 0;
+            for(int b = 0; b < 8; b++) x |= uint64_t(uint8_t(data[pos - 8 + b])) << (8*b);
+            return x;
+        }
+
+        double f64()
+        {
+            uint64_t bits = u64();
+            double x;
+            std::memcpy(&x, &bits, sizeof(x));
+            return x;
+        }
+
+        std::string rest()
+        {
+            std::string s(data + pos, size - pos);
+            pos = size;
+            return s;
+        }
+
+    private:
+        const char* data;
+        size_t size;
+        size_t pos = 0;
+        bool overrun = false;
+
+        bool take(size_t n)
+        {
+            if(pos + n > size) { overrun = true; return false; }
+            pos += n;
+            return true;
+        }
+    };
+
+    inline std::vector<char> message(uint32_t type, const std::vector<char>& payload)
+    {
+        std::vector<char> out;
+        put_u32(out, type);
+        put_u32(out, uint32_t(payload.size()));
+        out.insert(out.end(), payload.begin(), payload.end());
+        return out;
+    }
+
+    inline std::vector<char> job_message(uint32_t job_id, const render_job_desc& job)
+    {
+        std::vector<char> payload;
+        put_u32(payload, job_id);
+        put_u32(payload, uint32_t(job.x0));
+        put_u32(payload, uint32_t(job.y0));
+        put_u32(payload, uint32_t(job.x1));
+        put_u32(payload, uint32_t(job.y1));
+        put_u32(payload, uint32_t(job.sample_begin));
+        put_u32(payload, uint32_t(job.sample_end));
+        return message(JOB, payload);
+    }
+
+    inline std::vector<char> result_message(uint32_t job_id, const framebuffer& part)
+    {
+        std::vector<char> payload;
+        payload.reserve(16 + size_t(part.width) * part.height * 104);
+        put_u32(payload, job_id);
+        put_u32(payload, uint32_t(part.width));
+        put_u32(payload, uint32_t(part.height));
+
+        for(size_t p = 0; p < part.beauty.size(); p++)
+        {
+            for(int k = 0; k < 3; k++) put_f64(payload, part.beauty[p][k]);
+            for(int k = 0; k < 3; k++) put_f64(payload, part.albedo[p][k]);
+            for(int k = 0; k < 3; k++) put_f64(payload, part.normal[p][k]);
+            put_f64(payload, part.depth[p]);
+            put_u32(payload, part.object_id[p]);
+            put_u32(payload, uint32_t(part.sample_count[p]));
+            put_f64(payload, part.time[p]);
+            put_f64(payload, part.occlusion[p]);
+        }
+        return message(RESULT, payload);
+    }
+
+    inline bool read_result(reader& in, uint32_t& job_id, framebuffer& part)
+    {
+        job_id = in.u32();
+        int width = int(in.u32());
+        int height = int(in.u32());
+        if(!in.ok() || width <= 0 || height <= 0 || width > (1 << 16) || height > (1 << 16))
+            return false;
+
+        part = framebuffer(width, height);
+        for(size_t p = 0; p < part.beauty.size(); p++)
+        {
+            for(int k = 0; k < 3; k++) part.beauty[p][k] = in.f64();
+            for(int k = 0; k < 3; k++) part.albedo[p][k] = in.f64();
+            for(int k = 0; k < 3; k++) part.normal[p][k] = in.f64();
+            part.depth[p] = in.f64();
+            part.object_id[p] = in.u32();
+            part.sample_count[p] = int(in.u32());
+            part.time[p] = float(in.f64());
+            part.occlusion[p] = in.f64();
+        }
+        return in.ok();
+    }
+}
+
+#ifndef _WIN32
+
+namespace wire
+{
+    inline bool send_all(int fd, const std::vector<char>& bytes)
+    {
+        size_t sent = 0;
+        while(sent < bytes.size())
+        {
+            // MSG_NOSIGNAL : a vanished peer is an error code, not a SIGPIPE.
+            auto n = ::send(fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+            if(n <= 0) return false;
+            sent += size_t(n);
+        }
+        return true;
+    }
+
+    inline bool recv_exact(int fd, char* out, size_t size)
+    {
+        size_t got = 0;
+        while(got < size)
+        {
+            auto n = ::recv(fd, out + got, size - got, 0);
+            if(n <= 0) return false;
+            got += size_t(n);
+        }
+        return true;
+    }
+
+    inline bool recv_message(int fd, uint32_t& type, std::vector<char>& payload)
+    {
+        // Blocking read of one whole message. (worker side)
+        char header[8];
+        if(!recv_exact(fd, header, 8)) return false;
+        reader in(header, 8);
+        type = in.u32();
+        auto size = in.u32();
+        payload.resize(size);
+        return size == 0 || recv_exact(fd, payload.data(), size);
+    }
+
+    inline bool pop_message(std::vector<char>& buffer, uint32_t& type, std::vector<char>& payload)
+    {
+        // Takes one whole message off the front of a receive buffer, if there is one.
+        // (coordinator side, which reads whatever has arrived from many workers)
+        if(buffer.size() < 8) return false;
+        reader in(buffer.data(), 8);
+        type = in.u32();
+        auto size = in.u32();
+        if(buffer.size() < 8 + size_t(size)) return false;
+        payload.assign(buffer.begin() + 8, buffer.begin() + 8 + size);
+        buffer.erase(buffer.begin(), buffer.begin() + 8 + size);
+        return true;
+    }
+}
+
+inline int run_worker(const std::string& address, scene_loader load)
+{
+    // Connects to a coordinator at "host:port" and renders jobs until told to stop.
+    auto colon = address.rfind(':');
+    if(colon == std::string::npos)
+    {
+        std::cerr << "ERROR : Worker address must be <host>:<port>.\n";
+        return 1;
+    }
+    auto host = address.substr(0, colon);
+    auto port = address.substr(colon + 1);
+
+    // The coordinator owns stdout (the image), keep anything a worker prints off it.
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    int fd = -1;
+    for(int attempt = 0; attempt < 50 && fd < 0; attempt++)
+    {
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if(getaddrinfo(host.c_str(), port.c_str(), &hints, &found) == 0)
+        {
+            for(auto a = found; a != nullptr && fd < 0; a = a->ai_next)
+            {
+                fd = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if(fd >= 0 && ::connect(fd, a->ai_addr, a->ai_addrlen) != 0)
+                {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            freeaddrinfo(found);
+        }
+        // The coordinator may not be up yet, retry for a few seconds.
+        if(fd < 0) usleep(100000);
+    }
+    if(fd < 0)
+    {
+        std::cerr << "ERROR : Could not connect to the coordinator at '" << address << "'.\n";
+        return 1;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    uint32_t type;
+    std::vector<char> payload;
+    if(!wire::recv_message(fd, type, payload) || type != wire::SCENE)
+    {
+        std::cerr << "ERROR : Coordinator did not send a scene.\n";
+        close(fd);
+        return 1;
+    }
+
+    scene scn;
+    std::string scene_name(payload.begin(), payload.end());
+    if(!load(scene_name, scn))
+    {
+        close(fd);
+        return 1;
+    }
+    scn.cam.initialize();
+    wire::send_all(fd, wire::message(wire::READY, std::vector<char>()));
+
+    int jobs_done = 0;
+    while(wire::recv_message(fd, type, payload))
+    {
+        if(type == wire::BYE) break;
+        if(type != wire::JOB) continue;
+
+        wire::reader in(payload.data(), payload.size());
+        auto job_id = in.u32();
+        render_job_desc job;
+        job.x0 = int(in.u32());
+        job.y0 = int(in.u32());
+        job.x1 = int(in.u32());
+        job.y1 = int(in.u32());
+        job.sample_begin = int(in.u32());
+        job.sample_end = int(in.u32());
+        if(!in.ok()) break;
+
+        auto part = scn.cam.render_job(scn.world, scn.light_list(), job);
+        if(!wire::send_all(fd, wire::result_message(job_id, part))) break;
+        jobs_done++;
+    }
+
+    std::clog << "Worker finished " << jobs_done << " jobs.\n";
+    close(fd);
+    return 0;
+}
+
+inline int run_coordinator(
+    const std::string& scene_name, scene& scn, const coordinator_settings& settings,
+    const char* executable
+)
+{
+    using clock = std::chrono::steady_clock;
+
+    camera& cam = scn.cam;
+    cam.initialize();
+    const int width = cam.image_width;
+    const int height = cam.height();
+
+    // Jobs : tiles x sample slices
+    std::vector<render_job_desc> jobs;
+    int slices = std::max(1, std::min(settings.sample_slices, cam.samples_per_pixel));
+    for(int y0 = 0; y0 < height; y0 += settings.job_size)
+    for(int x0 = 0; x0 < width; x0 += settings.job_size)
+    for(int s = 0; s < slices; s++)
+    {
+        render_job_desc job;
+        job.x0 = x0;
+        job.y0 = y0;
+        job.x1 = std::min(x0 + settings.job_size, width);
+        job.y1 = std::min(y0 + settings.job_size, height);
+        job.sample_begin = cam.samples_per_pixel * s / slices;
+        job.sample_end = cam.samples_per_pixel * (s + 1) / slices;
+        jobs.push_back(job);
+    }
+
+    // Listen
+    int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(uint16_t(settings.port));
+    if(listen_fd < 0 || ::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, 64) != 0)
+    {
+        std::cerr << "ERROR : Could not listen on port " << settings.port << ".\n";
+        if(listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
+    socklen_t addr_size = sizeof(addr);
+    getsockname(listen_fd, (sockaddr*)&addr, &addr_size);
+    int port = ntohs(addr.sin_port);
+    std::clog << "Coordinator listening on port " << port << ", " << jobs.size() << " jobs.\n";
+
+    // Local workers
+    std::vector<pid_t> children;
+    for(int k = 0; k < settings.spawn_workers; k++)
+    {
+        pid_t pid = fork();
+        if(pid == 0)
+        {
+            close(listen_fd);
+            std::string address = "127.0.0.1:" + std::to_string(port);
+            // Linux knows our own binary, elsewhere fall back to argv[0] (searched in PATH).
+            execl("/proc/self/exe", executable, "--worker", address.c_str(), (char*)nullptr);
+            execlp(executable, executable, "--worker", address.c_str(), (char*)nullptr);
+            _exit(127);
+        }
+        if(pid > 0) children.push_back(pid);
+    }
+
+    struct worker_state
+    {
+        int fd;
+        std::vector<char> buffer;
+        bool ready = false;
+        int job = -1;                   // job in flight, -1 : idle
+        clock::time_point job_start;
+    };
+    std::vector<worker_state> workers;
+
+    std::deque<int> pending;
+    for(int j = 0; j < int(jobs.size()); j++) pending.push_back(j);
+    std::vector<bool> done(jobs.size(), false);
+    int remaining = int(jobs.size());
+
+    framebuffer fb(width, height);
+    auto last_worker_seen = clock::now();
+    bool failed = false;
+
+    auto assign = [&](worker_state& w, int j)
+    {
+        w.job = j;
+        w.job_start = clock::now();
+        if(wire::send_all(w.fd, wire::job_message(uint32_t(j), jobs[j]))) return;
+
+        // Lost worker : the job goes back to the front of the queue and the worker gets no
+        // more work. The connection is dropped with the closed ones below.
+        pending.push_front(j);
+        close(w.fd);
+        w.fd = -1;
+        w.ready = false;
+        w.job = -1;
+    };
+
+    while(remaining > 0)
+    {
+        // Hand out work to idle workers. Queued jobs first, then duplicates of overdue jobs.
+        for(auto& w : workers)
+        {
+            if(!w.ready || w.job >= 0) continue;
+
+            while(!pending.empty() && done[pending.front()]) pending.pop_front();
+            if(!pending.empty())
+            {
+                int j = pending.front();
+                pending.pop_front();
+                assign(w, j);
+                continue;
+            }
+
+            for(auto& other : workers)
+            {
+                if(other.job < 0 || done[other.job]) continue;
+                std::chrono::duration<double> running = clock::now() - other.job_start;
+                if(running.count() > settings.job_timeout)
+                {
+                    assign(w, other.job);
+                    break;
+                }
+            }
+        }
+
+        std::vector<pollfd> fds(1 + workers.size());
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        for(size_t k = 0; k < workers.size(); k++)
+        {
+            fds[k+1].fd = workers[k].fd;
+            fds[k+1].events = POLLIN;
+        }
+        poll(fds.data(), fds.size(), 500);
+
+        if(fds[0].revents & POLLIN)
+        {
+            int fd = ::accept(listen_fd, nullptr, nullptr);
+            if(fd >= 0)
+            {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                std::vector<char> name(scene_name.begin(), scene_name.end());
+                if(wire::send_all(fd, wire::message(wire::SCENE, name)))
+                {
+                    worker_state w;
+                    w.fd = fd;
+                    workers.push_back(w);
+                }
+                else close(fd);
+            }
+        }
+
+        for(size_t k = 0; k < workers.size(); k++)
+        {
+            auto& w = workers[k];
+            if(!(fds[k+1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            char chunk[65536];
+            auto n = ::recv(w.fd, chunk, sizeof(chunk), 0);
+            if(n <= 0)
+            {
+                // Lost worker : its job goes back to the front of the queue.
+                if(w.job >= 0 && !done[w.job]) pending.push_front(w.job);
+                close(w.fd);
+                w.fd = -1;
+                continue;
+            }
+            w.buffer.insert(w.buffer.end(), chunk, chunk + n);
+
+            uint32_t type;
+            std::vector<char> payload;
+            while(wire::pop_message(w.buffer, type, payload))
+            {
+                if(type == wire::READY) w.ready = true;
+                if(type != wire::RESULT) continue;
+
+                wire::reader in(payload.data(), payload.size());
+                uint32_t job_id;
+                framebuffer part;
+                if(wire::read_result(in, job_id, part) && job_id < jobs.size() && !done[job_id])
+                {
+                    const auto& job = jobs[job_id];
+                    if(part.width == job.x1 - job.x0 && part.height == job.y1 - job.y0)
+                    {
+                        fb.merge(part, job.x0, job.y0);
+                        done[job_id] = true;
+                        remaining--;
+                        std::clog << "\rJobs remaining: " << remaining << ' ' << std::flush;
+                    }
+                }
+                if(int(job_id) == w.job) w.job = -1;
+            }
+        }
+
+        // Drop closed connections.
+        size_t kept = 0;
+        for(size_t k = 0; k < workers.size(); k++)
+            if(workers[k].fd >= 0) workers[kept++] = workers[k];
+        workers.resize(kept);
+
+        if(!workers.empty()) last_worker_seen = clock::now();
+        std::chrono::duration<double> alone = clock::now() - last_worker_seen;
+        if(alone.count() > settings.worker_wait)
+        {
+            std::cerr << "\nERROR : No workers for " << settings.worker_wait << "s, giving up.\n";
+            failed = true;
+            break;
+        }
+    }
+
+    for(auto& w : workers)
+    {
+        wire::send_all(w.fd, wire::message(wire::BYE, std::vector<char>()));
+        close(w.fd);
+    }
+    close(listen_fd);
+    for(auto pid : children) waitpid(pid, nullptr, 0);
+
+    if(failed) return 1;
+    std::clog << "\rDone.                   \n";
+
+    cam.write_output(fb);
+    return 0;
+}
+
+#else
+
+inline int run_worker(const std::string&, scene_loader)
+{
+    std::cerr << "ERROR : Distributed rendering is not supported on this platform.\n";
+    return 1;
+}
+
+inline int run_coordinator(const std::string&, scene&, const coordinator_settings&, const char*)
+{
+    std::cerr << "ERROR : Distributed rendering is not supported on this platform.\n";
+    return 1;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+// Polynomial approximations of the libm functions on the shading hot paths.
+//
+// Every approximation is branch free apart from selects, so it inlines and vectorizes
+// where libm calls can't. Maximum absolute errors over the whole domain, against libm
+// (checked by tests/fast_math_test.cc) :
+//
+//   approx_acos(x)        x in [-1,1]         2.2e-8 rad    (Abramowitz & Stegun 4.4.46)
+//   approx_atan2(y, x)    any finite y, x     1.4e-8 rad    (Abramowitz & Stegun 4.4.49)
+//   approx_sin_cos(x)     |x| < 1e4           7.0e-12       (Taylor, after a quadrant reduction)
+//   pow5(x)               any x               3 ulp         (3 multiplies instead of pow)
+//
+// The renderer doesn't call these directly but through the math_* functions below, which
+// pick the exact or the approximate version by the current mode. The mode is per thread and
+// set by the camera before each block of pixels it renders (camera::fast_math), so it follows
+// the render a thread is working on, also with renders of different modes sharing the threads
+// (the render server); its default is on for builds with RT_FAST_MATH (cmake -DRT_FAST_MATH=ON).
+// sqrt isn't approximated, it's a single hardware instruction already.
+
+#include <cmath>
+#include <cstdint>
+
+#ifdef RT_FAST_MATH
+    #define RT_FAST_MATH_DEFAULT true
+#else
+    #define RT_FAST_MATH_DEFAULT false
+#endif
+
+inline bool& fast_math_enabled()
+{
+    static thread_local bool enabled = RT_FAST_MATH_DEFAULT;
+    return enabled;
+}
+
+inline double approx_acos(double x)
+{
+    // acos(|x|) = sqrt(1-|x|) * P(|x|), and acos(-x) = pi - acos(x).
+    auto a = std::fabs(x);
+    auto p = -0.0012624911;
+    p = p * a + 0.0066700901;
+    p = p * a - 0.0170881256;
+    p = p * a + 0.0308918810;
+    p = p * a - 0.0501743046;
+    p = p * a + 0.0889789874;
+    p = p * a - 0.2145988016;
+    p = p * a + 1.5707963050;
+    auto r = std::sqrt(std::fmax(0.0, 1 - a)) * p;
+    return x < 0 ? pi - r : r;
+}
+
+inline double approx_atan2(double y, double x)
+{
+    // atan of the ratio in [0,1] (smaller over larger magnitude), then mirrored into the
+    // octant of (x, y).
+    auto ax = std::fabs(x), ay = std::fabs(y);
+    auto hi = std::fmax(ax, ay), lo = std::fmin(ax, ay);
+    auto t = hi > 0 ? lo / hi : 0.0;
+
+    auto t2 = t * t;
+    auto p = 0.0028662257;
+    p = p * t2 - 0.0161657367;
+    p = p * t2 + 0.0429096138;
+    p = p * t2 - 0.0752896400;
+    p = p * t2 + 0.1065626393;
+    p = p * t2 - 0.1420889944;
+    p = p * t2 + 0.1999355085;
+    p = p * t2 - 0.3333314528;
+    auto r = t + t * t2 * p;
+
+    r = ay > ax ? pi/2 - r : r;
+    r = x < 0 ? pi - r : r;
+    return std::signbit(y) ? -r : r;
+}
+
+inline void approx_sin_cos(double x, double& s, double& c)
+{
+    // x = q*pi/2 + r with |r| <= pi/4 (pi/2 split in two parts so r stays accurate),
+    // then sin and cos of r by their Taylor series, swapped and negated by the quadrant q.
+    auto q = std::nearbyint(x * (2/pi));
+    auto r = (x - q * 1.57079632673412561417) - q * 6.07710050650619224932e-11;
+
+    auto r2 = r * r;
+    auto sr = r * (1 + r2 * (-1.0/6 + r2 * (1.0/120 + r2 * (-1.0/5040 + r2 * (1.0/362880
+            + r2 * (-1.0/39916800))))));
+    auto cr = 1 + r2 * (-0.5 + r2 * (1.0/24 + r2 * (-1.0/720 + r2 * (1.0/40320
+            + r2 * (-1.0/3628800 + r2 * (1.0/479001600))))));
+
+    auto quadrant = int(int64_t(q) & 3);
+    auto sin_abs = (quadrant & 1) ? cr : sr;
+    auto cos_abs = (quadrant & 1) ? sr : cr;
+    s = (quadrant & 2) ? -sin_abs : sin_abs;
+    c = ((quadrant + 1) & 2) ? -cos_abs : cos_abs;
+}
+
+inline double pow5(double x)
+{
+    auto x2 = x * x;
+    return x2 * x2 * x;
+}
+
+/* Mode switched functions, used by the renderer */
+
+inline double math_acos(double x)
+{
+    return fast_math_enabled() ? approx_acos(x) : std::acos(x);
+}
+
+inline double math_atan2(double y, double x)
+{
+    return fast_math_enabled() ? approx_atan2(y, x) : std::atan2(y, x);
+}
+
+inline void math_sin_cos(double x, double& s, double& c)
+{
+    if(fast_math_enabled())
+    {
+        approx_sin_cos(x, s, c);
+        return;
+    }
+    s = std::sin(x);
+    c = std::cos(x);
+}
+
+inline double math_pow5(double x)
+{
+    return fast_math_enabled() ? pow5(x) : std::pow(x, 5);
+}
+
+#endif
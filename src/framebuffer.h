@@ -0,0 +1,259 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "color.h"
+
+// Arbitrary output variables. All of them come out of the same render pass, from the same 
+// primary hits, and each one is saved to its own file.
+enum class Aov
+{
+    BEAUTY,         // Shaded image
+    NORMAL,         // First hit shading normal, averaged over the pixel's samples
+    ALBEDO,         // First hit surface albedo (background for misses)
+    DEPTH,          // First hit distance from the camera, averaged over hits (0 : no hit)
+    OBJECT_ID,      // Id of the object the pixel's first sample hit (0 : no hit)
+    SAMPLE_COUNT,   // Samples taken for the pixel
+    TIME,           // Wall clock seconds spent on the pixel
+    AMBIENT_OCCLUSION   // Unoccluded part of the first hit's hemisphere (1 : open, 0 : covered)
+};
+
+inline const char* aov_name(Aov aov)
+{
+    switch(aov)
+    {
+        case Aov::BEAUTY:       return "beauty";
+        case Aov::NORMAL:       return "normal";
+        case Aov::ALBEDO:       return "albedo";
+        case Aov::DEPTH:        return "depth";
+        case Aov::OBJECT_ID:    return "object_id";
+        case Aov::SAMPLE_COUNT: return "sample_count";
+        case Aov::TIME:         return "time";
+        case Aov::AMBIENT_OCCLUSION: return "ao";
+    }
+    return "unknown";
+}
+
+// First hit data (denoising guides and AOVs) of a single camera sample.
+struct sample_guides
+{
+    color       albedo = color(0,0,0);
+    vec3        normal = vec3(0,0,0);
+    double      depth = 0;              // 0 : the sample hit nothing
+    uint32_t    object_id = 0;          // 0 : the sample hit nothing
+    double      occlusion = 1;          // Ambient occlusion, when it's rendered (1 : open)
+};
+
+// A rectangle of pixels [x0,x1) x [y0,y1) and the range of their samples 
+// [sample_begin, sample_end) to render. The unit of work of split renders.
+struct render_job_desc
+{
+    int x0 = 0, y0 = 0, x1 = 0, y1 = 0;
+    int sample_begin = 0, sample_end = 0;
+};
+
+// Linear (pre-gamma) image kept in memory for the whole render, one vector per channel.
+class framebuffer
+{
+public:
+    int width = 0;
+    int height = 0;
+
+    std::vector<color>      beauty;         // Averaged radiance
+    std::vector<color>      albedo;         
+    std::vector<vec3>       normal;         
+    std::vector<double>     depth;          
+    std::vector<uint32_t>   object_id;      
+    std::vector<int>        sample_count;   
+    std::vector<float>      time;           
+    std::vector<double>     occlusion;      
+
+    framebuffer() {}
+
+    framebuffer(int width, int height)
+        : width(width), height(height),
+          beauty(size_t(width) * height), albedo(size_t(width) * height), 
+          normal(size_t(width) * height), depth(size_t(width) * height, 0.0),
+          object_id(size_t(width) * height, 0), sample_count(size_t(width) * height, 0),
+          time(size_t(width) * height, 0.0f), occlusion(size_t(width) * height, 1.0) {}
+
+    size_t index(int i, int j) const { return size_t(j) * width + i; }
+
+    color aov_value(Aov aov, size_t p) const
+    {
+        // Channel value of pixel p as an RGB triple. Scalars are copied to all three.
+        switch(aov)
+        {
+            case Aov::BEAUTY:       return beauty[p];
+            case Aov::NORMAL:       return normal[p];
+            case Aov::ALBEDO:       return albedo[p];
+            case Aov::DEPTH:        return color(depth[p], depth[p], depth[p]);
+            case Aov::OBJECT_ID:    return color(object_id[p], object_id[p], object_id[p]);
+            case Aov::SAMPLE_COUNT: return color(sample_count[p], sample_count[p], sample_count[p]);
+            case Aov::TIME:         return color(time[p], time[p], time[p]);
+            case Aov::AMBIENT_OCCLUSION: return color(occlusion[p], occlusion[p], occlusion[p]);
+        }
+        return color(0,0,0);
+    }
+
+    void merge(const framebuffer& part, int x0, int y0)
+    {
+        // Merges "part" (e.g. a rendered job) into this image at offset (x0, y0).
+        // Both are per-pixel averages, so they are combined weighted by their sample counts.
+        // Merging into pixels with no samples yet is a plain copy.
+        for(int j = 0; j < part.height; j++)
+        {
+            for(int i = 0; i < part.width; i++)
+            {
+                auto p = part.index(i, j);
+                auto q = index(x0 + i, y0 + j);
+                auto n0 = sample_count[q];
+                auto n1 = part.sample_count[p];
+                if(n1 == 0) continue;
+
+                double w1 = double(n1) / (n0 + n1);
+                double w0 = 1 - w1;
+
+                beauty[q] = w0 * beauty[q] + w1 * part.beauty[p];
+                albedo[q] = w0 * albedo[q] + w1 * part.albedo[p];
+                normal[q] = w0 * normal[q] + w1 * part.normal[p];
+                if(depth[q] <= 0) depth[q] = part.depth[p];
+                else if(part.depth[p] > 0) depth[q] = w0 * depth[q] + w1 * part.depth[p];
+                if(object_id[q] == 0) object_id[q] = part.object_id[p];
+                sample_count[q] = n0 + n1;
+                time[q] += part.time[p];
+                occlusion[q] = w0 * occlusion[q] + w1 * part.occlusion[p];
+            }
+        }
+    }
+
+    void write_ppm(std::ostream& out) const
+    {
+        // Gamma and quantization happen here, in write_color, on the final linear values.
+        out << "P3\n" << width << ' ' << height << "\n255\n";
+        for(const auto& pixel_color : beauty)
+            write_color(out, pixel_color);
+    }
+
+    void write_pfm(std::ostream& out, Aov aov) const
+    {
+        // Portable float map : raw 32-bit floats, no gamma and no clamping, so data channels
+        // (depth, ids, times, signed normals) survive exactly. Rows are stored bottom to top,
+        // and the negative scale marks little endian data.
+        out << "PF\n" << width << ' ' << height << "\n-1.0\n";
+        for(int j = height - 1; j >= 0; j--)
+        {
+            for(int i = 0; i < width; i++)
+            {
+                auto value = aov_value(aov, index(i, j));
+                float rgb[3] = { float(value.x()), float(value.y()), float(value.z()) };
+                write_little_endian(out, rgb, 3);
+            }
+        }
+    }
+
+    bool write_pfm(const std::string& filename, Aov aov) const
+    {
+        std::ofstream out(filename, std::ios::binary);
+        if(!out)
+        {
+            std::cerr << "ERROR : Could not write the file '" << filename << "'.\n";
+            return false;
+        }
+        write_pfm(out, aov);
+        return bool(out);
+    }
+
+    void write_ppm_rows(std::ostream& out, int y0, int y1) const
+    {
+        // Rows [y0,y1) of write_ppm's body, without the header.
+        std::ostringstream text;
+        for(size_t p = index(0, y0); p < index(0, y1); p++)
+            write_color(text, beauty[p]);
+        out << text.str();
+    }
+
+private:
+    static void write_little_endian(std::ostream& out, const float* values, int count)
+    {
+        for(int k = 0; k < count; k++)
+        {
+            uint32_t bits;
+            std::memcpy(&bits, &values[k], sizeof(bits));
+            char bytes[4] = { char(bits & 0xff), char((bits >> 8) & 0xff),
+                              char((bits >> 16) & 0xff), char((bits >> 24) & 0xff) };
+            out.write(bytes, 4);
+        }
+    }
+};
+
+// Writes a framebuffer's beauty image as ppm while it's being rendered. The image is cut in
+// bands of rows; once every tile of a band is reported done, a background thread encodes the
+// band and writes it, so encoding and output overlap with tracing the bands below.
+class ppm_band_writer
+{
+public:
+    ppm_band_writer(const framebuffer& fb, std::ostream& out, int band_height, int tiles_per_band)
+        : fb(fb), out(out), band_height(band_height), tiles_per_band(tiles_per_band),
+          tiles_done((fb.height + band_height - 1) / band_height, 0)
+    {
+        out << "P3\n" << fb.width << ' ' << fb.height << "\n255\n";
+        writer = std::thread([this] { write_bands(); });
+    }
+
+    ~ppm_band_writer() { finish(); }
+
+    ppm_band_writer(const ppm_band_writer&) = delete;
+    ppm_band_writer& operator=(const ppm_band_writer&) = delete;
+
+    // A tile of the band is in the framebuffer, and won't change anymore.
+    void tile_done(int band)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tiles_done[band]++;
+        }
+        band_ready.notify_one();
+    }
+
+    // Waits for the writes, every tile must have been reported done.
+    void finish()
+    {
+        if(writer.joinable()) writer.join();
+        out.flush();
+    }
+
+private:
+    const framebuffer& fb;
+    std::ostream& out;
+    int band_height;
+    int tiles_per_band;
+    std::vector<int> tiles_done;
+    std::mutex mutex;
+    std::condition_variable band_ready;
+    std::thread writer;
+
+    void write_bands()
+    {
+        for(int band = 0; band < int(tiles_done.size()); band++)
+        {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                band_ready.wait(lock, [&] { return tiles_done[band] == tiles_per_band; });
+            }
+            fb.write_ppm_rows(out, band * band_height, std::min(fb.height, (band + 1) * band_height));
+        }
+    }
+};
+
+#endif
@@ -3,18 +3,21 @@
 
 #include "aabb.h"
 
-class material; // forward declaration
+#include <cstdint>
+
+struct material_data; // forward declaration
 
 class hit_record
 {
 public:
     point3 p;       // ray hit point
     vec3 normal;
-    shared_ptr<material> mat;
+    const material_data* mat;   // flattened material of the hit surface
     double t;
     double u;
     double v;
     bool front_face;
+    uint32_t object_id; // id of the primitive that was hit
 
     void set_face_normal(const ray& r, const vec3& outward_normal)
     {
@@ -26,6 +29,12 @@ public:
 class hittable
 {
 public:
+    // Every object gets a non-zero id in construction order, counted per constructing thread :
+    // unique among the objects a thread builds, and the same for every build of a scene
+    // that starts on a fresh thread (the per node copies, scene::replicate_per_node), so
+    // the object id AOV doesn't depend on which copy traced a pixel.
+    hittable() : object_id(next_object_id()) {}
+
     // This default virtual destructor forces derived class's 
     // destructor to be called when deleted.
     // Otherwise, derived class's destructor cannot be called 
@@ -35,6 +44,50 @@ public:
     
     virtual bool hit(const ray& r, interval ray_t, hit_record& rec) const = 0;
 
+    // Visibility only query (shadow rays, ambient occlusion) : true if anything is hit in 
+    // ray_t. Stops at the first hit found, in any order, and fills in no hit record.
+    // This default goes through hit(), objects override it with something cheaper.
+    virtual bool occluded(const ray& r, interval ray_t) const
+    {
+        hit_record rec;
+        return hit(r, ray_t, rec);
+    }
+
     virtual aabb bounding_box() const = 0;
+
+    // Light sampling interface, used for next-event estimation.
+    // pdf_value : solid angle density of random() generating "direction" from "origin".
+    // random : a direction from "origin" towards this object, built from the uniform 
+    //          numbers u1, u2 in [0,1).
+    // Objects that can't be sampled as lights keep these defaults.
+    virtual double pdf_value(const point3& origin, const vec3& direction) const
+    {
+        return 0.0;
+    }
+
+    virtual vec3 random(const point3& origin, double u1, double u2) const
+    {
+        return vec3(1,0,0);
+    }
+
+    // Recomputes cached bounds after animated objects below this one have moved.
+    // Acceleration structures and lists override it, plain primitives have nothing to update.
+    virtual void refit() {}
+
+    // True if the object's geometry depends on the ray time (motion blur). The camera skips 
+    // drawing ray times for scenes where nothing moves.
+    virtual bool is_moving() const { return false; }
+
+    uint32_t id() const { return object_id; }
+
+protected:
+    uint32_t object_id;
+
+private:
+    static uint32_t next_object_id()
+    {
+        static thread_local uint32_t counter = 0;
+        return ++counter;
+    }
 };
 #endif
\ No newline at end of file
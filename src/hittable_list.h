@@ -4,6 +4,7 @@
 #include "aabb.h"
 #include "hittable.h"
 
+#include <algorithm>
 #include <vector>
 
 using std::make_shared;
@@ -45,9 +46,58 @@ public:
 
         return hit_anything;
     }
+
+    bool occluded(const ray& r, interval ray_t) const override
+    {
+        for(const auto& object : objects)
+            if(object->occluded(r, ray_t)) return true;
+        return false;
+    }
     
     aabb bounding_box() const override { return bbox; }
 
+    bool is_moving() const override
+    {
+        for(const auto& object : objects)
+            if(object->is_moving()) return true;
+        return false;
+    }
+
+    void refit() override
+    {
+        bbox = aabb::empty;
+        for(const auto& object : objects)
+        {
+            object->refit();
+            bbox = aabb(bbox, object->bounding_box());
+        }
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override
+    {
+        // random() picks one object uniformly, so the density is the average of all.
+        if(objects.empty()) return 0.0;
+
+        auto weight = 1.0 / objects.size();
+        auto sum = 0.0;
+
+        for(const auto& object : objects)
+            sum += weight * object->pdf_value(origin, direction);
+
+        return sum;
+    }
+
+    vec3 random(const point3& origin, double u1, double u2) const override
+    {
+        if(objects.empty()) return vec3(1,0,0);
+
+        // u1 picks the object, and what's left of it is stretched back to [0,1)
+        // so the chosen object still gets two well distributed numbers.
+        auto scaled = u1 * objects.size();
+        auto index = std::min(size_t(scaled), objects.size() - 1);
+        return objects[index]->random(origin, scaled - index, u2);
+    }
+
 private:
     aabb bbox;
 };
@@ -49,6 +49,16 @@ public:
     static const interval empty, universe;
 };
 
+interval operator+(const interval& ival, double displacement)
+{
+    return interval(ival.min + displacement, ival.max + displacement);
+}
+
+interval operator+(double displacement, const interval& ival)
+{
+    return ival + displacement;
+}
+
 const interval interval::empty = interval(+infinity, -infinity);
 const interval interval::universe = interval(-infinity, +infinity);
 
@@ -2,31 +2,41 @@
 
 #include "bvh.h"
 #include "camera.h"
+#include "camera_rig.h"
+#include "distributed.h"
+#include "perf_check.h"
+#include "scene.h"
+#include "server.h"
 #include "material.h"
+#include "quad.h"
 #include "texture.h"
 #include "sphere.h"
 
 #include <ctime>
+#include <functional>
+#include <random>
+#include <sstream>
 
 #pragma message("Including: " __FILE__)
 
-void bouncing_spheres() 
+void bouncing_spheres(scene& scn) 
 {
+    scene_arena& arena = scn.arena;   // Objects and (deduplicated) materials of the scene
     //World
-    hittable_list world;
+    hittable_list& world = scn.world;
 
     // auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    auto checker = make_shared<checker_texture>(0.32, color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
-    world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(checker)));
+    auto checker = arena.intern<checker_texture>(0.32, color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    world.add(arena.make<sphere>(point3(0,-1000,0), 1000, arena.intern<lambertian>(checker)));
 
-    auto material1 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material1));
+    auto material1 = arena.intern<lambertian>(color(0.4, 0.2, 0.1));
+    world.add(arena.make<sphere>(point3(-4, 1, 0), 1.0, material1));
 
-    auto material2 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material2));
+    auto material2 = arena.intern<dielectric>(1.5);
+    world.add(arena.make<sphere>(point3(0, 1, 0), 1.0, material2));
 
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
+    auto material3 = arena.intern<metal>(color(0.7, 0.6, 0.5), 0.0);
+    world.add(arena.make<sphere>(point3(4, 1, 0), 1.0, material3));
 
     int dcnt, mcnt, dicnt;
     dcnt = mcnt = dicnt = 0;
@@ -42,33 +52,33 @@ void bouncing_spheres()
                 if (choose_mat < 0.8) {
                     // diffuse
                     auto albedo = color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
+                    sphere_material = arena.intern<lambertian>(albedo);
                     auto center2 = center + vec3(0, random_double(0,0.5), 0);
-                    world.add(make_shared<sphere>(center, center2, 0.2, sphere_material));
+                    world.add(arena.make<sphere>(center, center2, 0.2, sphere_material));
                     dcnt++;
                 } else if (choose_mat < 0.95) {
                     // metal
                     auto albedo = color::random(0.5, 1);
                     auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = arena.intern<metal>(albedo, fuzz);
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
                     mcnt++;
                 }else {
                     // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
+                    sphere_material = arena.intern<dielectric>(1.5);
+                    world.add(arena.make<sphere>(center, 0.2, sphere_material));
                     dicnt++;
                 }
             }
         }
     }
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    // The ground sphere is kept out of the tree, next to it. (split_bvh_outliers)
+    world = hittable_list(arena.make<bvh_node>(world, &arena));
 
     std::clog << dcnt << ' ' << mcnt << ' ' << dicnt << '\n';
 
-    camera cam;
-    cam.render_mode = Render_mode::MATERIAL;
+    camera& cam = scn.cam;
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
     cam.samples_per_pixel = 100;
@@ -81,22 +91,20 @@ void bouncing_spheres()
 
     cam.defocus_angle = 0.6;
     cam.focus_dist    = 10.0;
-
-    cam.render(world);
 }
 
-void checkered_spheres()
+void checkered_spheres(scene& scn)
 {
-    hittable_list world;
+    scene_arena& arena = scn.arena;
+    hittable_list& world = scn.world;
 
-    auto checker = make_shared<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    auto checker = arena.intern<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
 
-    world.add(make_shared<sphere>(point3(0,-10, 0), 10, make_shared<lambertian>(checker)));
-    world.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
+    world.add(arena.make<sphere>(point3(0,-10, 0), 10, arena.intern<lambertian>(checker)));
+    world.add(arena.make<sphere>(point3(0, 10, 0), 10, arena.intern<lambertian>(checker)));
 
-    camera cam;
+    camera& cam = scn.cam;
 
-    cam.render_mode = Render_mode::MATERIAL;
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
     cam.samples_per_pixel = 100;
@@ -108,16 +116,16 @@ void checkered_spheres()
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
-
-    cam.render(world);
 }
 
-void earth() {
-    hittable_list world;
+void earth(scene& scn)
+{
+    scene_arena& arena = scn.arena;
+    hittable_list& world = scn.world;
     
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0,0,-1), 2, earth_surface);
+    auto earth_texture = arena.intern<image_texture>("earthmap.jpg");
+    auto earth_surface = arena.intern<lambertian>(earth_texture);
+    auto globe = arena.make<sphere>(point3(0,0,-1), 2, earth_surface);
     world.add(globe);
     
     /*
@@ -131,9 +139,8 @@ void earth() {
     world.add(ground_geometry);
     */
 
-    camera cam;
+    camera& cam = scn.cam;
 
-    cam.render_mode = Render_mode::MATERIAL;
     cam.aspect_ratio      = 16.0 / 9.0;
     cam.image_width       = 400;
     cam.samples_per_pixel = 100;
@@ -145,29 +152,350 @@ void earth() {
     cam.vup      = vec3(0,1,0);
 
     cam.defocus_angle = 0;
+}
+
+void simple_light(scene& scn)
+{
+    scene_arena& arena = scn.arena;
+    hittable_list& world = scn.world;
+
+    auto checker = arena.intern<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(arena.make<sphere>(point3(0,-1000,0), 1000, arena.intern<lambertian>(checker)));
+    world.add(arena.make<sphere>(point3(0,2,0), 2, arena.intern<lambertian>(color(0.4, 0.2, 0.1))));
+    world.add(arena.make<sphere>(point3(4,1.2,-2), 1.2, arena.intern<metal>(color(0.7, 0.6, 0.5), 0.3)));
+
+    // Small sphere lights, sampled explicitly through the "lights" list.
+    hittable_list& lights = scn.lights;
+    auto light1 = arena.make<sphere>(point3(0,7,0), 1, arena.intern<diffuse_light>(color(4,4,4)));
+    auto light2 = arena.make<sphere>(point3(-3,2.5,4), 0.5, arena.intern<diffuse_light>(color(12,8,4)));
+    world.add(light1);
+    world.add(light2);
+    lights.add(light1);
+    lights.add(light2);
+
+    camera& cam = scn.cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 10;
+    cam.max_depth         = 50;
+    cam.sky_gradient      = false;
+    cam.background        = color(0,0,0);
+    cam.denoise           = true;   // 10 spp is still noisy, filter it with the first hit guides
+
+    cam.vfov     = 20;
+    cam.lookfrom = point3(26,3,6);
+    cam.lookat   = point3(0,2,0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+}
+
+void quads(scene& scn)
+{
+    scene_arena& arena = scn.arena;
+    hittable_list& world = scn.world;
+
+    // Materials
+    auto left_red     = arena.intern<lambertian>(color(1.0, 0.2, 0.2));
+    auto back_green   = arena.intern<lambertian>(color(0.2, 1.0, 0.2));
+    auto right_blue   = arena.intern<lambertian>(color(0.2, 0.2, 1.0));
+    auto upper_orange = arena.intern<lambertian>(color(1.0, 0.5, 0.0));
+    auto lower_teal   = arena.intern<lambertian>(color(0.2, 0.8, 0.8));
+
+    // Quads
+    world.add(arena.make<quad>(point3(-3,-2, 5), vec3(0, 0,-4), vec3(0, 4, 0), left_red));
+    world.add(arena.make<quad>(point3(-2,-2, 0), vec3(4, 0, 0), vec3(0, 4, 0), back_green));
+    world.add(arena.make<quad>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
+    world.add(arena.make<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
+    world.add(arena.make<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
+
+    // Infinite ground plane, kept next to the BVH
+    auto checker = arena.intern<checker_texture>(0.5, color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    world.add(arena.make<plane>(point3(0,-4,0), vec3(0,1,0), arena.intern<lambertian>(checker)));
+
+    world = hittable_list(arena.make<bvh_node>(world, &arena));
+
+    camera& cam = scn.cam;
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 400;
+    cam.samples_per_pixel = 100;
+    cam.max_depth         = 50;
+
+    cam.vfov     = 80;
+    cam.lookfrom = point3(0,0,9);
+    cam.lookat   = point3(0,0,0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+}
+
+void bouncing_sequence(scene& scn)
+{
+    scene_arena& arena = scn.arena;
+    // Animation : a grid of bouncing balls, a few of them swapping places across the grid,
+    // under an orbiting camera.
+    hittable_list& world = scn.world;
+    scene_animation& animation = scn.animation;
+
+    animation.frames     = 48;
+    animation.frame_time = 1.0 / 24.0;
+
+    auto checker = arena.intern<checker_texture>(0.32, color(.2, .3, .1), color(.9, .9, .9));
+    world.add(arena.make<sphere>(point3(0,-1000,0), 1000, arena.intern<lambertian>(checker)));
+
+    for(int a = -5; a < 5; a++)
+    {
+        for(int b = -5; b < 5; b++)
+        {
+            shared_ptr<material> ball_material;
+            auto choose_mat = random_double();
+            if(choose_mat < 0.7) ball_material = arena.intern<lambertian>(color::random() * color::random());
+            else if(choose_mat < 0.9) ball_material = arena.intern<metal>(color::random(0.5, 1), random_double(0, 0.5));
+            else ball_material = arena.intern<dielectric>(1.5);
+
+            auto ball = animation.animate(arena.make<sphere>(point3(a + 0.5, 0.3, b + 0.5), 0.3, ball_material));
+
+            // One bounce per half second, phase shifted per ball.
+            auto phase = random_double(0, 0.5);
+            for(double t = -phase; t < 2.5; t += 0.5)
+            {
+                ball->offsets.add(t, vec3(0,0,0));
+                ball->offsets.add(t + 0.25, vec3(0,1.5,0));
+            }
+
+            // Every 10th ball crosses the whole grid, which degrades a refitted BVH.
+            if((a + b) % 10 == 0)
+            {
+                ball->offsets = keyframes<vec3>();
+                ball->offsets.add(0, vec3(0,0,0));
+                ball->offsets.add(2, vec3(-2.0*a, 0, -2.0*b));
+            }
+
+            world.add(ball);
+        }
+    }
+
+    camera& cam = scn.cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = 320;
+    cam.samples_per_pixel = 16;
+    cam.max_depth         = 20;
+
+    cam.vfov     = 30;
+    cam.vup      = vec3(0,1,0);
+    cam.defocus_angle = 0;
+
+    // Quarter orbit around the grid while looking at its center.
+    for(int k = 0; k <= 8; k++)
+    {
+        auto angle = pi * (0.25 + 0.5 * k / 8.0);
+        animation.lookfrom.add(2.0 * k / 8.0, point3(18 * std::cos(angle), 6, 18 * std::sin(angle)));
+    }
+    animation.lookat.add(0, point3(0,0.5,0));
+}
+
+struct stress_settings
+{
+    // Generator parameters, set from the scene name :
+    // "stress_spheres:count=1e6,clusters=32,spread=0.5,size_var=0.5,moving=0.1,metal=0.2,glass=0.1"
+    double  count       = 1e4;  // Number of spheres, 1e4 to 1e8
+    int     clusters    = 0;    // Gaussian clusters, 0 : uniform in the volume
+    double  spread      = 0.5;  // Cluster size relative to the even spacing of the clusters
+    double  radius      = 0.2;  // Mean sphere radius
+    double  size_var    = 0.0;  // Radius variance, log-normal sigma
+    double  moving      = 0.0;  // Fraction of moving (motion blurred) spheres
+    double  metal       = 0.2;  // Fraction of metal spheres
+    double  glass       = 0.1;  // Fraction of glass spheres, the rest is diffuse
+    int     width       = 400;  // Image width
+    int     spp         = 8;    // Samples per pixel
+    int     seed        = 1;
+};
+
+void stress_spheres(scene& scn, const stress_settings& stress)
+{
+    // Procedural scene for scaling measurements : "count" spheres in a cube sized so the
+    // sphere density stays the same at any count. Reports memory per primitive and per BVH
+    // node and the build time, the render then reports rays/s.
+    scene_arena& arena = scn.arena;
+    hittable_list& world = scn.world;
+    std::mt19937_64 rng(stress.seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+
+    size_t count = size_t(stress.count);
+    auto half_size = stress.radius * 2.5 * std::cbrt(double(count)) / 2;   // ~5 radii between neighbours
+
+    std::vector<point3> cluster_centers;
+    for(int k = 0; k < stress.clusters; k++)
+        cluster_centers.push_back(point3(
+            (2*uniform(rng) - 1) * half_size, (2*uniform(rng) - 1) * half_size, (2*uniform(rng) - 1) * half_size));
+    auto cluster_sigma = stress.clusters > 0 ? stress.spread * half_size / std::cbrt(double(stress.clusters)) : 0;
+
+    // A small palette, so materials are shared (interned) at any count.
+    const int palette = 64;
+
+    auto build_start = std::chrono::steady_clock::now();
+    auto rss_start = resident_memory_bytes();
+    world.objects.reserve(count);
+
+    for(size_t n = 0; n < count; n++)
+    {
+        point3 center;
+        if(cluster_centers.empty())
+            center = point3((2*uniform(rng) - 1) * half_size, (2*uniform(rng) - 1) * half_size, (2*uniform(rng) - 1) * half_size);
+        else
+            center = cluster_centers[size_t(uniform(rng) * cluster_centers.size()) % cluster_centers.size()]
+                   + cluster_sigma * vec3(normal(rng), normal(rng), normal(rng));
+
+        auto radius = stress.radius * std::exp(stress.size_var * normal(rng));
+
+        shared_ptr<material> sphere_material;
+        auto choose_mat = uniform(rng);
+        int shade = int(uniform(rng) * palette);
+        color tint(0.2 + 0.8 * (shade % 4) / 3.0, 0.2 + 0.8 * (shade / 4 % 4) / 3.0, 0.2 + 0.8 * (shade / 16) / 3.0);
+        if(choose_mat < stress.metal) sphere_material = arena.intern<metal>(tint, 0.1 * (shade % 3));
+        else if(choose_mat < stress.metal + stress.glass) sphere_material = arena.intern<dielectric>(1.5);
+        else sphere_material = arena.intern<lambertian>(tint);
+
+        if(uniform(rng) < stress.moving)
+            world.add(arena.make<sphere>(center, center + vec3(0, radius, 0), radius, sphere_material));
+        else
+            world.add(arena.make<sphere>(center, radius, sphere_material));
+    }
+    auto rss_primitives = resident_memory_bytes();
+    std::chrono::duration<double> generate_time = std::chrono::steady_clock::now() - build_start;
+
+    auto bvh_start = std::chrono::steady_clock::now();
+    auto bvh = arena.make<bvh_node>(std::move(world), &arena);
+    world = hittable_list(bvh);
+    auto rss_bvh = resident_memory_bytes();
+    std::chrono::duration<double> bvh_time = std::chrono::steady_clock::now() - bvh_start;
+
+    std::clog << "Stress scene : " << count << " spheres, " << bvh->inner_nodes() << " BVH nodes, "
+              << arena.objects() - arena.deduplicated() << " arena objects\n"
+              << "  generate " << generate_time.count() << "s, BVH build " << bvh_time.count() << "s\n"
+              << "  bytes per primitive " << double(rss_primitives - rss_start) / count
+              << " (sizeof sphere " << sizeof(sphere) << ")\n"
+              << "  bytes per BVH node " << double(rss_bvh - rss_primitives) / bvh->inner_nodes()
+              << " (sizeof bvh_node " << sizeof(bvh_node) << ")\n"
+              << "  peak RSS after build " << peak_resident_bytes() / 1e6 << " MB\n";
+
+    camera& cam = scn.cam;
+
+    cam.aspect_ratio      = 16.0 / 9.0;
+    cam.image_width       = stress.width;
+    cam.samples_per_pixel = stress.spp;
+    cam.max_depth         = 8;
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(0, 0.6, 1) * (half_size * 2.6);
+    cam.lookat   = point3(0,0,0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+}
 
-    // cam.render(world);
-    cam.render(world);
+bool parse_stress_settings(const std::string& parameters, stress_settings& stress)
+{
+    // "count=1e6,clusters=32,..." -> stress
+    std::istringstream in(parameters);
+    std::string item;
+    while(std::getline(in, item, ','))
+    {
+        auto eq = item.find('=');
+        if(eq == std::string::npos) return false;
+        auto key = item.substr(0, eq);
+        auto value = std::atof(item.substr(eq + 1).c_str());
+
+        if(key == "count") stress.count = value;
+        else if(key == "clusters") stress.clusters = int(value);
+        else if(key == "spread") stress.spread = value;
+        else if(key == "radius") stress.radius = value;
+        else if(key == "size_var") stress.size_var = value;
+        else if(key == "moving") stress.moving = value;
+        else if(key == "metal") stress.metal = value;
+        else if(key == "glass") stress.glass = value;
+        else if(key == "width") stress.width = int(value);
+        else if(key == "spp") stress.spp = int(value);
+        else if(key == "seed") stress.seed = int(value);
+        else return false;
+    }
+    return true;
 }
 
-void scene_run(void (*scene_function)())
+struct run_options
+{
+    // Command line overrides of a scene's camera for local renders
+    std::string preview_file;
+    double      time_budget = 0;
+    uint64_t    ray_budget  = 0;
+    size_t      texture_cache_bytes = 0;    // Stream image textures through a cache this big
+    bool        numa = false;               // Pin threads and build a scene copy per NUMA node
+    std::vector<Aov> aovs;                  // Extra outputs, added to the scene's
+    std::string rig;                        // Render the views of a camera rig (camera_rig.h)
+};
+
+void scene_run(const std::function<void(scene&)>& scene_function, const run_options& options = run_options())
 {
-    if(scene_function == nullptr) return;
+    if(!scene_function) return;
 
     clock_t start, finish;
     double duration;
     start = clock();
 
-    scene_function();
+    // Must be enabled before the scene creates its textures.
+    auto& textures = texture_cache::global();
+    textures.enable(options.texture_cache_bytes);
+
+    scene scn;
+    if(options.numa)
+    {
+        const numa_topology& topology = numa_topology::system();
+        std::clog << "NUMA : " << topology.node_count() << " nodes\n";
+        run_on_node(0, [&] { scene_function(scn); });
+        // Sequences move the objects of one scene between frames, they aren't replicated.
+        if(scn.animation.frames == 0) scn.replicate_per_node(scene_function);
+        else scn.cam.pin_threads = true;
+    }
+    else scene_function(scn);
+    scn.cam.preview_file = options.preview_file;
+    if(options.time_budget > 0) scn.cam.time_budget = options.time_budget;
+    if(options.ray_budget > 0) scn.cam.ray_budget = options.ray_budget;
+    for(auto aov : options.aovs)
+        if(std::find(scn.cam.aovs.begin(), scn.cam.aovs.end(), aov) == scn.cam.aovs.end())
+            scn.cam.aovs.push_back(aov);
+    if(!options.rig.empty())
+    {
+        rig_settings rig;
+        parse_camera_rig(options.rig, rig);
+        if(scn.animation.frames > 0) std::clog << "Sequences render the scene camera only, ignoring --rig\n";
+        else scn.views = make_camera_rig(rig, scn.cam);
+    }
+    if(scn.animation.frames > 0) scn.render_sequence();
+    else scn.render();
     
     finish = clock();
 
     duration = (double)(finish - start) / CLOCKS_PER_SEC;
     std::clog << duration << "s\n";
+    std::clog << "Peak RSS " << peak_resident_bytes() / 1e6 << " MB\n";
+
+    if(textures.enabled())
+    {
+        auto stats = textures.stats();
+        auto requests = stats.hits + stats.misses;
+        std::clog << "Texture cache : " << stats.hits << " hits, " << stats.misses << " misses ("
+                  << (requests > 0 ? 100.0 * stats.hits / requests : 0) << "% hit rate), " 
+                  << stats.evictions << " evictions, " << stats.peak_bytes / 1e6 << " MB peak of a "
+                  << textures.budget_bytes() / 1e6 << " MB budget\n";
+    }
 }
 
 
-void (*cmd_input(std::string argv_scene_name))()
+std::function<void(scene&)> cmd_input(std::string argv_scene_name)
 {
     if(argv_scene_name == "bouncing_spheres")
         return bouncing_spheres;
@@ -175,6 +503,30 @@ void (*cmd_input(std::string argv_scene_name))()
         return checkered_spheres;
     else if(argv_scene_name == "earth")
         return earth;
+    else if(argv_scene_name == "simple_light")
+        return simple_light;
+    else if(argv_scene_name == "quads")
+        return quads;
+    else if(argv_scene_name == "bouncing_sequence")
+        return bouncing_sequence;
+    else if(argv_scene_name.compare(0, 14, "stress_spheres") == 0)
+    {
+        // "stress_spheres" or "stress_spheres:key=value,..." (see stress_settings)
+        auto colon = argv_scene_name.find(':');
+        if(argv_scene_name.size() > 14 && colon != 14) 
+        {
+            std::cerr << "Invalid scene name\n";
+            return nullptr;
+        }
+        // Parameters of this name only, from the defaults : the server builds several in turn.
+        stress_settings stress;
+        if(colon != std::string::npos && !parse_stress_settings(argv_scene_name.substr(colon + 1), stress))
+        {
+            std::cerr << "Invalid stress_spheres parameters\n";
+            return nullptr;
+        }
+        return [stress](scene& scn) { stress_spheres(scn, stress); };
+    }
     else
     {
         std::cerr << "Invalid scene name\n";
@@ -182,6 +534,15 @@ void (*cmd_input(std::string argv_scene_name))()
     }
 }
 
+bool load_scene(const std::string& name, scene& scn)
+{
+    // Scene loader for distributed workers
+    auto scene_function = cmd_input(name);
+    if(!scene_function) return false;
+    scene_function(scn);
+    return true;
+}
+
 int main(int argc, char *argv[])
 {   
     std::clog << "Ray Tracing in One Weekend\n";
@@ -189,14 +550,143 @@ int main(int argc, char *argv[])
     std::clog << "Current Available Scenes:\n \
         [bouncing_spheres], \n \
         [checkered_spheres]\n \
-        [earth]\n";
+        [earth]\n \
+        [simple_light]\n \
+        [quads]\n \
+        [bouncing_sequence]\n \
+        [stress_spheres:count=1e4,clusters=0,spread=0.5,size_var=0,moving=0,metal=0.2,glass=0.1]\n";
+
+    const char* usage =
+        "Usage: ./main [scene_name]\n"
+        "       ./main [scene_name] [--preview file] [--budget seconds] [--rays count] [--texture-cache MB] [--numa 1]\n"
+        "                      [--aov normal|albedo|depth|object_id|sample_count|time|ao] ...\n"
+        "                      [--rig stereo[:ipd=0.065]|cubemap|turntable[:views=8]]\n"
+        "       ./main [scene_name] --coordinator [port] [--spawn N] [--slices K] [--job-size PX]\n"
+        "       ./main --worker [host:port]\n"
+        "       ./main --server [port] [cache MB]\n"
+        "       ./main --perf-check [baseline.json] [--output dir] [--update]\n";
+
+    if(argc == 3 && std::string(argv[1]) == "--worker")
+        return run_worker(argv[2], load_scene);
+
+    // Render server : keeps scenes built between requests
+    if((argc == 3 || argc == 4) && std::string(argv[1]) == "--server")
+    {
+        server_settings settings;
+        settings.port = std::atoi(argv[2]);
+        if(argc == 4) settings.cache_bytes = size_t(std::atol(argv[3])) << 20;
+        return run_server(settings, load_scene);
+    }
+
+    // Performance regression check against a stored baseline (see perf_check.h)
+    if(argc >= 3 && std::string(argv[1]) == "--perf-check")
+    {
+        std::string output_dir = "perf_output";
+        bool update = false;
+        for(int k = 3; k < argc; k++)
+        {
+            std::string option = argv[k];
+            if(option == "--update") update = true;
+            else if(option == "--output" && k + 1 < argc) output_dir = argv[++k];
+            else
+            {
+                std::cerr << usage;
+                return 1;
+            }
+        }
+        return run_perf_check(argv[2], output_dir, update, load_scene);
+    }
+
+    if(argc < 2)
+    {
+        std::cerr << usage;
+        return 1;
+    }
+
+    // Local render : <scene> [options]
+    if(argc == 2 || std::string(argv[2]) != "--coordinator")
+    {
+        run_options options;
+        for(int k = 2; k < argc; k += 2)
+        {
+            std::string option = argv[k];
+            if(k + 1 >= argc)
+            {
+                std::cerr << usage;
+                return 1;
+            }
+            // Progressive render, published to a memory-mapped file after every pass
+            if(option == "--preview") options.preview_file = argv[k+1];
+            // Stop adding samples at a wall clock deadline or after a number of rays
+            else if(option == "--budget") options.time_budget = std::atof(argv[k+1]);
+            else if(option == "--rays") options.ray_budget = std::strtoull(argv[k+1], nullptr, 10);
+            // Page image textures in from tiled files, keeping at most this many MB of tiles
+            else if(option == "--texture-cache") options.texture_cache_bytes = size_t(std::atof(argv[k+1]) * (1 << 20));
+            // Pin render threads across NUMA nodes, each node tracing its own copy of the scene
+            else if(option == "--numa") options.numa = std::atoi(argv[k+1]) != 0;
+            // Render all views of a camera rig over the one scene build, each to its own file
+            else if(option == "--rig")
+            {
+                rig_settings rig;
+                if(!parse_camera_rig(argv[k+1], rig))
+                {
+                    std::cerr << usage;
+                    return 1;
+                }
+                options.rig = argv[k+1];
+            }
+            // Write an AOV next to the image, "ao" renders ambient occlusion (camera::ao_samples)
+            else if(option == "--aov")
+            {
+                bool found = false;
+                for(int a = int(Aov::BEAUTY); a <= int(Aov::AMBIENT_OCCLUSION); a++)
+                {
+                    if(argv[k+1] != std::string(aov_name(Aov(a)))) continue;
+                    options.aovs.push_back(Aov(a));
+                    found = true;
+                }
+                if(!found)
+                {
+                    std::cerr << usage;
+                    return 1;
+                }
+            }
+            else
+            {
+                std::cerr << usage;
+                return 1;
+            }
+        }
 
-    if(argc != 2)
+        auto scene_function = cmd_input(argv[1]);
+        scene_run(scene_function, options);
+        return 0;
+    }
+
+    // Distributed : <scene> --coordinator <port> [options]
+    if(argc < 4)
     {
-        std::cerr << "Usage: ./main [scene_name]\n";
+        std::cerr << usage;
         return 1;
     }
 
-    void (*scene_function)() = cmd_input(argv[1]);
-    scene_run(scene_function);
-}
\ No newline at end of file
+    coordinator_settings settings;
+    settings.port = std::atoi(argv[3]);
+    for(int k = 4; k + 1 < argc; k += 2)
+    {
+        std::string option = argv[k];
+        int value = std::atoi(argv[k+1]);
+        if(option == "--spawn") settings.spawn_workers = value;
+        else if(option == "--slices") settings.sample_slices = std::max(1, value);
+        else if(option == "--job-size") settings.job_size = std::max(1, value);
+        else
+        {
+            std::cerr << usage;
+            return 1;
+        }
+    }
+
+    scene scn;
+    if(!load_scene(argv[1], scn)) return 1;
+    return run_coordinator(argv[1], scn, settings, argv[0]);
+}
@@ -1,41 +1,272 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include "onb.h"
 #include "texture.h"
 
+class material;  // forward declaration
+
+// Flattened (tagged) representation of a material.
+// Like texture_data, every material class fills this struct when it is constructed,
+// and the renderer shades through material_scatter() below, a switch the compiler can
+// inline, instead of the virtual scatter().
+struct material_data
+{
+    enum class kind
+    {
+        LAMBERTIAN,     // diffuse, albedo from tex (or albedo when tex is null)
+        METAL,          // fuzzy reflection (albedo, fuzz)
+        DIELECTRIC,     // refraction (refraction_index)
+        DIFFUSE_LIGHT,  // emitter, emission from tex (or albedo when tex is null)
+        CUSTOM          // user defined material, falls back to the virtual scatter()
+    };
+
+    kind type = kind::CUSTOM;
+    const texture_data* tex = nullptr;
+    color albedo;
+    double fuzz = 0;
+    double fuzz_cos_max = 1;        // cosine of the fuzz cone half angle, sin = fuzz
+    double refraction_index = 1;
+    const material* custom = nullptr;
+};
+
 class material
 {
 public:
+    // Materials that don't flatten themselves stay CUSTOM and are called virtually.
+    material() { flat.custom = this; }
+
     virtual ~material() = default;
 
+    // Material objects are referenced by address from their flattened data.
+    material(const material&) = delete;
+    material& operator=(const material&) = delete;
+
     virtual bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const
     {
         return false;
     }
+
+    // Light emitted by the surface. Black for everything but lights.
+    virtual color emitted(double u, double v, const point3& p) const
+    {
+        return color(0,0,0);
+    }
+
+    const material_data& data() const { return flat; }
+
+protected:
+    material_data flat;
 };
 
+inline double reflectance(double cosine, double refraction_index)
+{
+    // Use Schlick's approximation for reflectance
+    auto r0 = (1-refraction_index) / (1+refraction_index);
+    r0 *= r0;
+    return r0 + (1-r0)*math_pow5(1-cosine);
+}
+
+inline bool material_scatter(
+    const material_data& mat, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered,
+    const scatter_sample& xi
+)
+{
+    // xi : the uniform numbers this bounce may use. (custom materials draw their own)
+    switch(mat.type)
+    {
+        case material_data::kind::LAMBERTIAN:
+        {
+            // Cosine weighted hemisphere around the normal. (lambertian distribution)
+            // Unlike "normal + random_unit_vector()", this can't degenerate to a zero vector.
+            onb uvw(rec.normal);
+            auto scatter_direction = uvw.transform(sample_cosine_hemisphere(xi.u1, xi.u2));
+
+            scattered = ray(rec.p, scatter_direction, r_in.time());
+            // attenuation is fractured reflectance form.
+            attenuation = mat.tex ? texture_value(*mat.tex, rec.u, rec.v, rec.p) : mat.albedo;
+            return true;
+        }
+
+        case material_data::kind::METAL:
+        {
+            // The fuzz lobe is a uniform cone around the mirror direction whose half angle
+            // has sine "fuzz". (the same extent as offsetting by a fuzz-radius sphere, 
+            // but with a closed form pdf that light sampling can weight against)
+            vec3 reflected = unit_vector(reflect(r_in.direction(), rec.normal));
+            if(mat.fuzz > 0)
+            {
+                onb uvw(reflected);
+                reflected = uvw.transform(sample_uniform_cone(xi.u1, xi.u2, mat.fuzz_cos_max));
+            }
+            scattered = ray(rec.p, reflected, r_in.time());
+            attenuation = mat.albedo;
+
+            // if fuzzed ray is under the surface, return false (absorbed)
+            return (dot(scattered.direction(), rec.normal) > 0);
+        }
+
+        case material_data::kind::DIELECTRIC:
+        {
+            // glass surface absorbs nothing, so attenuation is always 1. (transparent)
+            attenuation = color(1.0,1.0,1.0);
+
+            double ri = rec.front_face ? (1.0/mat.refraction_index) : mat.refraction_index;
+
+            vec3 unit_direction = unit_vector(r_in.direction());
+            auto cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
+            auto sin_theta = std::sqrt(1.0-cos_theta*cos_theta);
+
+            bool cannot_refract = ri * sin_theta > 1.0;
+            vec3 direction;
+
+            if(cannot_refract || reflectance(cos_theta, ri) > xi.choice) // bigger than critical angle
+                direction = reflect(unit_direction, rec.normal);
+            else
+                direction = refract(unit_direction, rec.normal, ri); 
+            
+            scattered = ray(rec.p, direction, r_in.time());
+            return true;
+        }
+
+        case material_data::kind::DIFFUSE_LIGHT:
+            return false;
+
+        case material_data::kind::CUSTOM:
+        default:
+            return mat.custom->scatter(r_in, rec, attenuation, scattered);
+    }
+}
+
+inline bool material_scatter(
+    const material_data& mat, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+)
+{
+    return material_scatter(mat, r_in, rec, attenuation, scattered, scatter_sample::random());
+}
+
+inline color material_emitted(const material_data& mat, const hit_record& rec)
+{
+    switch(mat.type)
+    {
+        case material_data::kind::DIFFUSE_LIGHT:
+            // Lights only emit from their outer side, which is also the only side 
+            // the light sampler (hittable::random) can see.
+            if(!rec.front_face) return color(0,0,0);
+            return mat.tex ? texture_value(*mat.tex, rec.u, rec.v, rec.p) : mat.albedo;
+
+        case material_data::kind::CUSTOM:
+            return mat.custom->emitted(rec.u, rec.v, rec.p);
+
+        default:
+            return color(0,0,0);
+    }
+}
+
+inline color material_albedo(const material_data& mat, const hit_record& rec)
+{
+    // Surface reflectance, used as a denoising guide.
+    switch(mat.type)
+    {
+        case material_data::kind::LAMBERTIAN:
+        case material_data::kind::DIFFUSE_LIGHT:
+            return mat.tex ? texture_value(*mat.tex, rec.u, rec.v, rec.p) : mat.albedo;
+
+        case material_data::kind::METAL:
+            return mat.albedo;
+
+        default:
+            return color(1,1,1);
+    }
+}
+
+// Next-event estimation support.
+// Only materials with a non-delta lobe can be evaluated for an arbitrary (light) direction.
+// For those, material_eval() returns the BSDF times cosine and material_pdf() the solid angle
+// density of material_scatter() choosing that direction, so that eval/pdf equals the
+// attenuation material_scatter() reports.
+inline bool material_samples_lights(const material_data& mat)
+{
+    return mat.type == material_data::kind::LAMBERTIAN
+        || (mat.type == material_data::kind::METAL && mat.fuzz > 0);
+}
+
+inline bool material_needs_uv(const material_data& mat)
+{
+    // Only textures read the surface coordinates. (custom materials might)
+    return mat.tex != nullptr || mat.type == material_data::kind::CUSTOM;
+}
+
+inline double material_pdf(
+    const material_data& mat, const ray& r_in, const hit_record& rec, const vec3& direction
+)
+{
+    vec3 unit_direction = unit_vector(direction);
+
+    switch(mat.type)
+    {
+        case material_data::kind::LAMBERTIAN:
+        {
+            // cosine weighted hemisphere
+            return cosine_hemisphere_pdf(dot(rec.normal, unit_direction));
+        }
+
+        case material_data::kind::METAL:
+        {
+            if(mat.fuzz <= 0) return 0;
+            vec3 reflected = unit_vector(reflect(r_in.direction(), rec.normal));
+            if(dot(reflected, unit_direction) < mat.fuzz_cos_max) return 0;
+            return uniform_cone_pdf(mat.fuzz_cos_max);
+        }
+
+        default:
+            return 0;
+    }
+}
+
+inline color material_eval(
+    const material_data& mat, const ray& r_in, const hit_record& rec, const vec3& direction
+)
+{
+    // Directions below the surface are absorbed by both lobes.
+    if(dot(direction, rec.normal) <= 0) return color(0,0,0);
+
+    auto pdf = material_pdf(mat, r_in, rec, direction);
+    if(pdf <= 0) return color(0,0,0);
+
+    if(mat.type == material_data::kind::LAMBERTIAN)
+        return pdf * (mat.tex ? texture_value(*mat.tex, rec.u, rec.v, rec.p) : mat.albedo);
+    return pdf * mat.albedo;
+}
+
 class lambertian : public material
 {
 public:
     // lambertian(const color& albedo) : albedo(albedo) {}
     // albedo is now embedded in texture
-    lambertian(const color& albedo) : tex(make_shared<solid_color>(albedo)) {}
-    lambertian(shared_ptr<texture> tex) : tex(tex) {}
+    lambertian(const color& albedo)
+    {
+        // Solid colors only live in the flattened data, no texture object is needed.
+        flat.type = material_data::kind::LAMBERTIAN;
+        flat.albedo = albedo;
+    }
+    lambertian(shared_ptr<texture> tex) : tex(tex) 
+    {
+        flat.type = material_data::kind::LAMBERTIAN;
+
+        // Solid colors are copied into the material itself, so shading them never
+        // touches the texture.
+        if(tex->data().type == texture_data::kind::SOLID) flat.albedo = tex->data().color0;
+        else flat.tex = &tex->data();
+    }
 
     bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override
     {
-        auto scatter_direction = rec.normal + random_unit_vector(); // Creates lambertian dist.
-
-        // Catch degenerate scatter direction
-        if(scatter_direction.near_zero()) scatter_direction = rec.normal;
-
-        scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = tex->value(rec.u, rec.v, rec.p); // attenuation is fractured reflectance form.
-        return true;
+        return material_scatter(flat, r_in, rec, attenuation, scattered);
     }
 
 private:
@@ -46,70 +277,65 @@ private:
 class metal : public material
 {
 public:
-    metal(const color& albedo, double fuzz) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+    metal(const color& albedo, double fuzz)
+    {
+        flat.type = material_data::kind::METAL;
+        flat.albedo = albedo;
+        flat.fuzz = fuzz < 1 ? fuzz : 1;  // radius of fuzz sphere
+        flat.fuzz_cos_max = std::sqrt(1 - flat.fuzz*flat.fuzz);
+    }
     // if fuzz is 0, just specular reflection occurs (note that this is not TIR). 
     // if fuzz is (>1), clamp to 1.
     bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override
     {
-        vec3 reflected = reflect(r_in.direction(), rec.normal);
-        reflected = unit_vector(reflected) + (fuzz * random_unit_vector());
-        scattered = ray(rec.p, reflected, r_in.time());
-        attenuation = albedo;
-
-        // if fuzzed ray is under the surface, return false (absorbed)
-        return (dot(scattered.direction(), rec.normal) > 0);
+        return material_scatter(flat, r_in, rec, attenuation, scattered);
     }
-
-private:
-    color albedo;
-    double fuzz; // radius of fuzz sphere, 
 };
 
 class dielectric : public material
 {
 public:
-    dielectric(double refraction_index) : refraction_index(refraction_index) {}
+    dielectric(double refraction_index)
+    {
+        // Refractive index in vacuum(1.0) or air(1.000293 = 1.0), or the ratio of the material's 
+        // refractive index over the refractive index of the enclosing media
+        flat.type = material_data::kind::DIELECTRIC;
+        flat.refraction_index = refraction_index;
+    }
 
     bool scatter(
         const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
     ) const override
     {
-        // glass surface absorbs nothing, so attenuation is always 1. (transparent)
-        attenuation = color(1.0,1.0,1.0);
-
-        double ri = rec.front_face ? (1.0/refraction_index) : refraction_index;
-
-        vec3 unit_direction = unit_vector(r_in.direction());
-        auto cos_theta = std::fmin(dot(-unit_direction, rec.normal), 1.0);
-        auto sin_theta = std::sqrt(1.0-cos_theta*cos_theta);
+        return material_scatter(flat, r_in, rec, attenuation, scattered);
+    }
+};
 
-        bool cannot_refract = ri * sin_theta > 1.0;
-        vec3 direction;
+class diffuse_light : public material
+{
+public:
+    diffuse_light(shared_ptr<texture> tex) : tex(tex)
+    {
+        flat.type = material_data::kind::DIFFUSE_LIGHT;
 
-        if(cannot_refract || reflectance(cos_theta, ri) > random_double()) // bigger than critical angle
-            direction = reflect(unit_direction, rec.normal);
-        else
-            direction = refract(unit_direction, rec.normal, ri); 
-        
-        scattered = ray(rec.p, direction, r_in.time());
-        return true;
+        if(tex->data().type == texture_data::kind::SOLID) flat.albedo = tex->data().color0;
+        else flat.tex = &tex->data();
+    }
+    diffuse_light(const color& emit)
+    {
+        flat.type = material_data::kind::DIFFUSE_LIGHT;
+        flat.albedo = emit;
     }
 
-private:
-    // Refractive index in vacuum(1.0) or air(1.000293 = 1.0), or the ratio of the material's refractive index over
-    // the refractive index of the enclosing media
-    double refraction_index;
-    //color albedo
-
-    static double reflectance(double cosine, double refraction_index)
+    color emitted(double u, double v, const point3& p) const override
     {
-        // Use Schlick's approximation for reflectance
-        auto r0 = (1-refraction_index) / (1+refraction_index);
-        r0 *= r0;
-        return r0 + (1-r0)*std::pow((1-cosine), 5);
+        return flat.tex ? texture_value(*flat.tex, u, v, p) : flat.albedo;
     }
+
+private:
+    shared_ptr<texture> tex;
 };
 
 #endif
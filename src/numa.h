@@ -0,0 +1,156 @@
+#ifndef NUMA_H
+#define NUMA_H
+
+// Processor topology for the thread pool : which CPUs belong to which NUMA node, and how
+// far the nodes are from each other.
+//
+// Read from /sys/devices/system/node on Linux, restricted to the CPUs the process may run
+// on. Anywhere else, or when sysfs has no node directories, the machine is one node holding
+// every hardware thread. No libnuma : the kernel places memory on the node of the thread
+// that first touches it, so pinning threads is all it takes to control where data goes.
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+    #include <pthread.h>
+    #include <sched.h>
+#endif
+
+struct numa_node
+{
+    int id = 0;                 // Kernel node number
+    std::vector<int> cpus;      // CPUs of the node the process may run on
+    std::vector<int> distance;  // Relative access cost to each node (by index in the topology)
+};
+
+class numa_topology
+{
+public:
+    std::vector<numa_node> nodes;
+
+    static const numa_topology& system()
+    {
+        static const numa_topology topology = detect();
+        return topology;
+    }
+
+    int node_count() const { return int(nodes.size()); }
+
+    // Other nodes of the topology from the nearest to the farthest, to steal work from.
+    std::vector<int> steal_order(int node) const
+    {
+        std::vector<int> order;
+        for(int k = 0; k < node_count(); k++)
+            if(k != node) order.push_back(k);
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b)
+        {
+            return nodes[node].distance[a] < nodes[node].distance[b];
+        });
+        return order;
+    }
+
+private:
+    static numa_topology detect()
+    {
+        numa_topology topology;
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        std::vector<int> ids;
+        for(int id = 0; id < 1024; id++)
+        {
+            std::string dir = "/sys/devices/system/node/node" + std::to_string(id);
+            std::ifstream cpulist(dir + "/cpulist");
+            if(!cpulist) continue;
+
+            numa_node node;
+            node.id = id;
+            std::string list;
+            std::getline(cpulist, list);
+            for(int cpu : parse_cpu_list(list))
+                if(!have_mask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                    node.cpus.push_back(cpu);
+            if(node.cpus.empty()) continue;     // Memory only node, or none of its CPUs allowed
+
+            std::ifstream distance(dir + "/distance");
+            int d;
+            while(distance >> d) node.distance.push_back(d);    // Indexed by kernel node number
+
+            ids.push_back(id);
+            topology.nodes.push_back(node);
+        }
+
+        // Distances by index in the topology instead of kernel node number
+        for(auto& node : topology.nodes)
+        {
+            std::vector<int> by_index;
+            for(int id : ids)
+                by_index.push_back(id < int(node.distance.size()) ? node.distance[id] : (id == node.id ? 10 : 20));
+            node.distance = by_index;
+        }
+#endif
+        if(topology.nodes.empty())
+        {
+            numa_node node;
+            int count = std::max(1, int(std::thread::hardware_concurrency()));
+            for(int cpu = 0; cpu < count; cpu++) node.cpus.push_back(cpu);
+            node.distance.push_back(10);
+            topology.nodes.push_back(node);
+        }
+        return topology;
+    }
+
+    static std::vector<int> parse_cpu_list(const std::string& list)
+    {
+        // "0-7,16-23"
+        std::vector<int> cpus;
+        std::stringstream ranges(list);
+        std::string range;
+        while(std::getline(ranges, range, ','))
+        {
+            if(range.empty()) continue;
+            auto dash = range.find('-');
+            int first = std::atoi(range.c_str());
+            int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+            for(int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        }
+        return cpus;
+    }
+};
+
+// Restricts the calling thread to the given CPUs. Does nothing where affinity isn't supported.
+inline void pin_current_thread(const std::vector<int>& cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for(int cpu : cpus)
+        if(cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpus;
+#endif
+}
+
+// Runs fn on a thread pinned to a node and waits for it, so the memory fn allocates and
+// initializes is placed on that node.
+inline void run_on_node(int node, const std::function<void()>& fn)
+{
+    std::thread runner([&]
+    {
+        pin_current_thread(numa_topology::system().nodes[node].cpus);
+        fn();
+    });
+    runner.join();
+}
+
+#endif
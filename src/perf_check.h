@@ -0,0 +1,495 @@
+#ifndef PERF_CHECK_H
+#define PERF_CHECK_H
+
+// Performance regression check.
+//
+// Renders a fixed set of reference configurations, measures each one and compares the
+// measurements with a stored baseline :
+//
+//   ./RTinOneWeekend --perf-check <baseline.json> [--output dir] [--update]
+//   cmake --build build --target perf_check         (perf_baseline to record)
+//
+// Every configuration runs in its own child process, so its peak memory is its own and a
+// crash shows up as a failed configuration. Each one runs "runs" times (thresholds.runs in 
+// the baseline, 5 by default) and keeps its best time and throughput, and its median memory,
+// so one slow run caused by the rest of the machine doesn't fail the check. Measured per 
+// configuration :
+//   seconds        wall time of the child : scene construction, BVH build and render
+//   mrays_per_s    rays traced per second of rendering
+//   peak_mb        peak resident memory of the child
+//   rmse           difference of the output image to the reference image, on 8-bit values
+//                  scaled to [0,1]
+// Scene generators are seeded and the samplers are deterministic per pixel and sample, so
+// an unchanged renderer reproduces the reference images exactly and any RMSE means the
+// change altered the image.
+//
+// The check fails when a configuration is slower than its baseline time by more than
+// time_ratio (or its throughput lower by as much), uses more than memory_ratio of its
+// baseline memory, exceeds the RMSE threshold, or has no baseline or reference to compare
+// with. Times and memory are machine specific : record the baseline on the machine that runs
+// the check, with --update, which rewrites the baseline and the reference images (stored in
+// references/ next to the baseline) from the current build.
+
+#include "scene.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/resource.h>
+    #include <sys/stat.h>
+    #include <sys/wait.h>
+    #include <unistd.h>
+#endif
+
+inline size_t peak_resident_bytes()
+{
+#ifndef _WIN32
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return size_t(usage.ru_maxrss) * 1024;     // kilobytes on Linux
+#else
+    return 0;
+#endif
+}
+
+struct perf_config
+{
+    const char* name;
+    const char* scene;      // Scene name, as on the command line
+    int width;              // Image width and samples per pixel, 0 : keep the scene's
+    int spp;
+};
+
+// Small enough to run in a few minutes on a laptop, while covering the textured, the
+// shallow and the deep (uniform and clustered, partly moving) BVH cases.
+inline const std::vector<perf_config>& perf_configs()
+{
+    static const std::vector<perf_config> configs = {
+        { "bouncing_spheres",  "bouncing_spheres",  200, 32 },
+        { "checkered_spheres", "checkered_spheres", 200, 64 },
+        { "earth",             "earth",             200, 256 },
+        { "stress_uniform",    "stress_spheres:count=1e5,width=200,spp=4", 0, 0 },
+        { "stress_clustered",  "stress_spheres:count=1e5,clusters=16,size_var=0.5,moving=0.1,width=200,spp=4", 0, 0 },
+    };
+    return configs;
+}
+
+struct perf_result
+{
+    bool   ran = false;
+    double seconds = 0;
+    double mrays_per_s = 0;
+    double peak_mb = 0;
+    double rmse = -1;       // -1 : no reference image to compare with
+};
+
+struct perf_thresholds
+{
+    double time_ratio   = 1.25;
+    double memory_ratio = 1.25;
+    double rmse         = 0.002;
+    int    runs         = 5;        // Renders per configuration, the best one is compared
+};
+
+/* Images */
+
+inline bool read_ppm(const std::string& filename, int& width, int& height, std::vector<unsigned char>& pixels)
+{
+    // P3 (what the renderer writes) or P6 (how references are stored), 8-bit.
+    std::ifstream in(filename, std::ios::binary);
+    std::string magic;
+    int max_value = 0;
+    if(!(in >> magic >> width >> height >> max_value) || max_value != 255 || width <= 0 || height <= 0)
+        return false;
+
+    pixels.resize(size_t(width) * height * 3);
+    if(magic == "P6")
+    {
+        in.get();   // The single whitespace after the header
+        return bool(in.read(reinterpret_cast<char*>(pixels.data()), pixels.size()));
+    }
+    if(magic != "P3") return false;
+    for(auto& value : pixels)
+    {
+        int v;
+        if(!(in >> v)) return false;
+        value = (unsigned char)v;
+    }
+    return true;
+}
+
+inline bool write_ppm_binary(const std::string& filename, int width, int height, const std::vector<unsigned char>& pixels)
+{
+    std::ofstream out(filename, std::ios::binary);
+    out << "P6\n" << width << ' ' << height << "\n255\n";
+    out.write(reinterpret_cast<const char*>(pixels.data()), pixels.size());
+    return bool(out);
+}
+
+inline double image_rmse(const std::vector<unsigned char>& a, const std::vector<unsigned char>& b)
+{
+    double sum = 0;
+    for(size_t k = 0; k < a.size(); k++)
+    {
+        double d = (double(a[k]) - double(b[k])) / 255.0;
+        sum += d * d;
+    }
+    return a.empty() ? 0 : std::sqrt(sum / a.size());
+}
+
+/* Baseline file */
+
+// The baseline is JSON made of nested objects of numbers only. It's read flattened to
+// dotted key paths : {"configs": {"earth": {"seconds": 1.5}}} -> "configs.earth.seconds".
+class perf_json_reader
+{
+public:
+    explicit perf_json_reader(const std::string& text) : text(text) {}
+
+    bool read(std::map<std::string, double>& values)
+    {
+        return parse_object("", values) && (skip_space(), pos == text.size());
+    }
+
+private:
+    const std::string& text;
+    size_t pos = 0;
+
+    void skip_space()
+    {
+        while(pos < text.size() && std::isspace((unsigned char)text[pos])) pos++;
+    }
+
+    bool expect(char c)
+    {
+        skip_space();
+        if(pos >= text.size() || text[pos] != c) return false;
+        pos++;
+        return true;
+    }
+
+    bool parse_string(std::string& out)
+    {
+        if(!expect('"')) return false;
+        auto end = text.find('"', pos);
+        if(end == std::string::npos) return false;
+        out = text.substr(pos, end - pos);
+        pos = end + 1;
+        return true;
+    }
+
+    bool parse_object(const std::string& prefix, std::map<std::string, double>& values)
+    {
+        if(!expect('{')) return false;
+        if(expect('}')) return true;
+        do
+        {
+            std::string key;
+            if(!parse_string(key) || !expect(':')) return false;
+            auto path = prefix.empty() ? key : prefix + "." + key;
+
+            skip_space();
+            if(pos < text.size() && text[pos] == '{')
+            {
+                if(!parse_object(path, values)) return false;
+            }
+            else
+            {
+                const char* start = text.c_str() + pos;
+                char* end = nullptr;
+                double value = std::strtod(start, &end);
+                if(end == start) return false;
+                pos += end - start;
+                values[path] = value;
+            }
+        } while(expect(','));
+        return expect('}');
+    }
+};
+
+inline bool write_perf_baseline(const std::string& filename, const perf_thresholds& limits,
+                                const std::vector<perf_result>& results)
+{
+    std::ofstream out(filename);
+    out << std::setprecision(6);
+    out << "{\n"
+        << "    \"thresholds\": {\n"
+        << "        \"time_ratio\": " << limits.time_ratio << ",\n"
+        << "        \"memory_ratio\": " << limits.memory_ratio << ",\n"
+        << "        \"rmse\": " << limits.rmse << ",\n"
+        << "        \"runs\": " << limits.runs << "\n"
+        << "    },\n"
+        << "    \"configs\": {\n";
+    auto& configs = perf_configs();
+    for(size_t k = 0; k < configs.size(); k++)
+    {
+        const perf_result& r = results[k];
+        out << "        \"" << configs[k].name << "\": { "
+            << "\"seconds\": " << r.seconds << ", "
+            << "\"mrays_per_s\": " << r.mrays_per_s << ", "
+            << "\"peak_mb\": " << r.peak_mb << " }"
+            << (k + 1 < configs.size() ? ",\n" : "\n");
+    }
+    out << "    }\n"
+        << "}\n";
+    return bool(out);
+}
+
+/* Running */
+
+inline std::string perf_directory_of(const std::string& path)
+{
+    auto slash = path.find_last_of("/\\");
+    return slash == std::string::npos ? std::string(".") : path.substr(0, slash);
+}
+
+inline void perf_make_directory(const std::string& path)
+{
+#ifndef _WIN32
+    mkdir(path.c_str(), 0755);
+#endif
+}
+
+#ifndef _WIN32
+inline perf_result run_perf_config(const perf_config& config, const std::string& output_file, scene_loader load)
+{
+    // Renders in a child process, which reports its measurements back through a pipe.
+    perf_result result;
+    int fds[2];
+    if(pipe(fds) != 0) return result;
+
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return result;
+    }
+    if(pid == 0)
+    {
+        close(fds[0]);
+
+        // Progress output goes to a log next to the image, to keep the report readable.
+        int log = open((output_file + ".log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(log >= 0)
+        {
+            dup2(log, STDERR_FILENO);
+            dup2(log, STDOUT_FILENO);
+            close(log);
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        scene scn;
+        if(!load(config.scene, scn)) _exit(2);
+        if(config.width > 0) scn.cam.image_width = config.width;
+        if(config.spp > 0) scn.cam.samples_per_pixel = config.spp;
+        scn.cam.output_file = output_file;
+        scn.render();
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+
+        char report[256];
+        int length = std::snprintf(report, sizeof report, "%.17g %.17g %.17g\n", wall.count(),
+            scn.cam.last_render_seconds > 0 ? scn.cam.last_render_rays / scn.cam.last_render_seconds / 1e6 : 0.0,
+            peak_resident_bytes() / 1e6);
+        ssize_t written = write(fds[1], report, length);
+        _exit(written == length ? 0 : 3);
+    }
+
+    close(fds[1]);
+    std::string report;
+    char buffer[256];
+    ssize_t n;
+    while((n = read(fds[0], buffer, sizeof buffer)) > 0) report.append(buffer, n);
+    close(fds[0]);
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != 0) return result;
+
+    std::istringstream in(report);
+    result.ran = bool(in >> result.seconds >> result.mrays_per_s >> result.peak_mb);
+    return result;
+}
+#endif
+
+#ifndef _WIN32
+inline perf_result run_perf_config_best(const perf_config& config, const std::string& output_file, scene_loader load, int runs)
+{
+    // Runs the configuration "runs" times : the shortest time and the highest throughput are
+    // what the renderer can do, the rest is other load on the machine. Peak memory barely
+    // varies, it's the median. Any failed run fails the configuration.
+    std::vector<double> seconds, mrays_per_s, peak_mb;
+    for(int run = 0; run < runs; run++)
+    {
+        auto r = run_perf_config(config, output_file, load);
+        if(!r.ran) return r;
+        seconds.push_back(r.seconds);
+        mrays_per_s.push_back(r.mrays_per_s);
+        peak_mb.push_back(r.peak_mb);
+    }
+
+    perf_result best;
+    best.ran = true;
+    best.seconds = *std::min_element(seconds.begin(), seconds.end());
+    best.mrays_per_s = *std::max_element(mrays_per_s.begin(), mrays_per_s.end());
+    std::sort(peak_mb.begin(), peak_mb.end());
+    best.peak_mb = peak_mb[peak_mb.size() / 2];
+    return best;
+}
+#endif
+
+inline int run_perf_check(const std::string& baseline_file, const std::string& output_dir, bool update, scene_loader load)
+{
+#ifdef _WIN32
+    std::cerr << "The performance check needs fork(), it isn't available on this platform\n";
+    return 1;
+#else
+    std::string reference_dir = perf_directory_of(baseline_file) + "/references";
+    perf_make_directory(output_dir);
+
+    // The baseline, unless it's being recorded
+    std::map<std::string, double> baseline;
+    perf_thresholds limits;
+    {
+        std::ifstream in(baseline_file);
+        std::stringstream text;
+        text << in.rdbuf();
+        if(in && !perf_json_reader(text.str()).read(baseline))
+        {
+            std::cerr << "Invalid baseline " << baseline_file << "\n";
+            return 1;
+        }
+        if(!in && !update)
+        {
+            std::cerr << "No baseline " << baseline_file << ", record one with --update\n";
+            return 1;
+        }
+        if(baseline.count("thresholds.time_ratio")) limits.time_ratio = baseline["thresholds.time_ratio"];
+        if(baseline.count("thresholds.memory_ratio")) limits.memory_ratio = baseline["thresholds.memory_ratio"];
+        if(baseline.count("thresholds.rmse")) limits.rmse = baseline["thresholds.rmse"];
+        if(baseline.count("thresholds.runs")) limits.runs = std::max(1, int(baseline["thresholds.runs"]));
+    }
+
+    auto& configs = perf_configs();
+    std::vector<perf_result> results(configs.size());
+    bool passed = true;
+
+    std::cout << std::left << std::setw(20) << "config"
+              << std::right << std::setw(18) << "seconds" << std::setw(18) << "Mrays/s"
+              << std::setw(18) << "peak MB" << std::setw(12) << "rmse" << "\n";
+    std::cout << std::fixed;
+
+    for(size_t k = 0; k < configs.size(); k++)
+    {
+        const perf_config& config = configs[k];
+        std::string output_file = output_dir + "/" + config.name + ".ppm";
+        std::string reference_file = reference_dir + "/" + config.name + ".ppm";
+        std::string key = std::string("configs.") + config.name + ".";
+
+        perf_result& r = results[k];
+        r = run_perf_config_best(config, output_file, load, limits.runs);
+        if(!r.ran)
+        {
+            std::cout << std::left << std::setw(20) << config.name << "FAILED to render, see "
+                      << output_file << ".log\n";
+            passed = false;
+            continue;
+        }
+
+        int width = 0, height = 0;
+        std::vector<unsigned char> image;
+        if(!read_ppm(output_file, width, height, image))
+        {
+            std::cout << std::left << std::setw(20) << config.name << "FAILED, unreadable " << output_file << "\n";
+            passed = false;
+            continue;
+        }
+
+        if(update)
+        {
+            perf_make_directory(reference_dir);
+            if(!write_ppm_binary(reference_file, width, height, image))
+            {
+                std::cerr << "Can't write " << reference_file << "\n";
+                return 1;
+            }
+            r.rmse = 0;
+        }
+        else
+        {
+            int reference_width = 0, reference_height = 0;
+            std::vector<unsigned char> reference;
+            if(read_ppm(reference_file, reference_width, reference_height, reference)
+               && reference_width == width && reference_height == height)
+                r.rmse = image_rmse(image, reference);
+        }
+
+        // Measured values, with their baseline and a mark on the ones out of bounds
+        auto column = [&](double value, const char* name, int precision, bool higher_is_worse, double ratio)
+        {
+            std::ostringstream cell;
+            cell << std::fixed << std::setprecision(precision) << value;
+            if(!update)
+            {
+                auto found = baseline.find(key + name);
+                if(found == baseline.end())
+                {
+                    cell << " (none)!";
+                    passed = false;
+                }
+                else
+                {
+                    double base = found->second;
+                    bool bad = higher_is_worse ? value > base * ratio : value < base / ratio;
+                    cell << " (" << std::setprecision(precision) << base << ")" << (bad ? "!" : " ");
+                    passed = passed && !bad;
+                }
+            }
+            std::cout << std::setw(18) << cell.str();
+        };
+
+        std::cout << std::left << std::setw(20) << config.name << std::right;
+        column(r.seconds, "seconds", 2, true, limits.time_ratio);
+        column(r.mrays_per_s, "mrays_per_s", 2, false, limits.time_ratio);
+        column(r.peak_mb, "peak_mb", 1, true, limits.memory_ratio);
+
+        bool image_bad = r.rmse < 0 || r.rmse > limits.rmse;
+        std::ostringstream cell;
+        if(r.rmse < 0) cell << "no ref!";
+        else cell << std::setprecision(5) << r.rmse << (image_bad ? "!" : " ");
+        std::cout << std::setw(12) << cell.str() << "\n";
+        passed = passed && !image_bad;
+    }
+
+    if(update)
+    {
+        if(!passed || !write_perf_baseline(baseline_file, limits, results))
+        {
+            std::cerr << "Baseline not written\n";
+            return 1;
+        }
+        std::cout << "Baseline written to " << baseline_file << ", references to " << reference_dir << "\n";
+        return 0;
+    }
+
+    std::cout << (passed ? "PASSED" : "FAILED") << " (best of " << limits.runs << " runs, limits : time x" << std::setprecision(2)
+              << limits.time_ratio << ", memory x" << limits.memory_ratio << ", rmse "
+              << std::setprecision(4) << limits.rmse << ")\n";
+    return passed ? 0 : 1;
+#endif
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+// Live preview of a progressive render, published through a memory-mapped file.
+//
+// After every pass the renderer writes the current image into the file, and a viewer that
+// maps the same file sees it without any copy or pipe. Layout (native byte order, it's
+// meant for processes on the same machine) :
+//
+//   offset  0 : char[4]  "RTPV"
+//           4 : u32      version (1)
+//           8 : u32      width
+//          12 : u32      height
+//          16 : u64      sequence, odd while a pass is being written, even when stable.
+//                        sequence / 2 is the number of published passes (the frame counter).
+//          24 : u32      block size of the pass, 1 once every pixel has its own sample
+//          28 : u32      samples per pixel so far
+//          32 : u32      samples per pixel of the finished image
+//          36 : u32      1 once the render is finished
+//          40 : u8[3 * width * height]  gamma corrected RGB, rows top to bottom (as the ppm)
+//
+// A viewer reads the sequence, copies or displays the pixels, and reads the sequence again;
+// if it changed or was odd, the frame was torn and it should try again. (seqlock)
+
+#include "framebuffer.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+#else
+    #include <fstream>
+#endif
+
+struct preview_header
+{
+    char     magic[4];
+    uint32_t version;
+    uint32_t width;
+    uint32_t height;
+    uint64_t sequence;
+    uint32_t block;
+    uint32_t samples;
+    uint32_t target_samples;
+    uint32_t finished;
+};
+
+class preview_publisher
+{
+public:
+    preview_publisher(const std::string& filename, int width, int height, int target_samples)
+      : filename(filename), width(width), height(height)
+    {
+        size = sizeof(preview_header) + size_t(3) * width * height;
+
+#ifndef _WIN32
+        int fd = ::open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+        if(fd >= 0 && ::ftruncate(fd, off_t(size)) == 0)
+        {
+            void* mapped = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(mapped != MAP_FAILED) data = static_cast<char*>(mapped);
+        }
+        if(fd >= 0) ::close(fd);   // The mapping stays valid after closing.
+#else
+        // No mmap here : keep the file in memory and rewrite it after each pass.
+        fallback.resize(size);
+        data = fallback.data();
+#endif
+        if(data == nullptr)
+        {
+            std::cerr << "ERROR : Could not map preview file '" << filename << "'.\n";
+            return;
+        }
+
+        std::memset(data, 0, size);
+        auto& h = header();
+        std::memcpy(h.magic, "RTPV", 4);
+        h.version = 1;
+        h.width = uint32_t(width);
+        h.height = uint32_t(height);
+        h.target_samples = uint32_t(target_samples);
+    }
+
+    ~preview_publisher()
+    {
+#ifndef _WIN32
+        if(data != nullptr) ::munmap(data, size);
+#endif
+    }
+
+    preview_publisher(const preview_publisher&) = delete;
+    preview_publisher& operator=(const preview_publisher&) = delete;
+
+    bool ok() const { return data != nullptr; }
+
+    void publish(const framebuffer& fb, int block, int samples, bool finished = false)
+    {
+        // Every pixel shows the first pixel of its block, so a coarse pass fills the whole
+        // image with blocks instead of leaving holes.
+        if(data == nullptr) return;
+
+        auto& h = header();
+        auto sequence = reinterpret_cast<std::atomic<uint64_t>*>(&h.sequence);
+        auto frame = sequence->load(std::memory_order_relaxed);
+        sequence->store(frame + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        h.block = uint32_t(block);
+        h.samples = uint32_t(samples);
+        h.finished = finished ? 1 : 0;
+
+        auto pixels = reinterpret_cast<uint8_t*>(data + sizeof(preview_header));
+        for(int j = 0; j < height; j++)
+        {
+            for(int i = 0; i < width; i++)
+            {
+                const auto& pixel_color = fb.beauty[fb.index(i - i % block, j - j % block)];
+                auto out = pixels + 3 * (size_t(j) * width + i);
+                out[0] = uint8_t(linear_to_byte(pixel_color.x()));
+                out[1] = uint8_t(linear_to_byte(pixel_color.y()));
+                out[2] = uint8_t(linear_to_byte(pixel_color.z()));
+            }
+        }
+
+        sequence->store(frame + 2, std::memory_order_release);
+
+#ifdef _WIN32
+        std::ofstream out(filename, std::ios::binary);
+        out.write(data, size);
+#endif
+    }
+
+private:
+    std::string filename;
+    int width, height;
+    size_t size = 0;
+    char* data = nullptr;
+#ifdef _WIN32
+    std::vector<char> fallback;
+#endif
+
+    preview_header& header() { return *reinterpret_cast<preview_header*>(data); }
+};
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef QUAD_H
+#define QUAD_H
+
+#include "hittable.h"
+#include "material.h"
+#include "onb.h"
+
+// Planar primitives. Both intersect the ray with the plane dot(normal, p) = D analytically;
+// the quad then keeps hits inside its parallelogram, the plane keeps them all.
+
+class quad : public hittable
+{
+public:
+    // Parallelogram with corner Q and edges u and v. (corners Q, Q+u, Q+v, Q+u+v)
+    quad(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat)
+      : Q(Q), u(u), v(v), mat(mat), mat_data(&mat->data())
+    {
+        auto n = cross(u, v);
+        normal = unit_vector(n);
+        D = dot(normal, Q);
+        w = n / dot(n, n);
+        area = n.length();
+
+        // A quad in an axis plane has a flat box, padded so it still has a volume.
+        bbox = aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v)).padded(0.0001);
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    {
+        double t, alpha, beta;
+        if(!intersect(r, ray_t, t, alpha, beta)) return false;
+
+        // Plane coordinates of the hit are its surface coordinates.
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.u = alpha;
+        rec.v = beta;
+        rec.mat = mat_data;
+        rec.object_id = object_id;
+        rec.set_face_normal(r, normal);
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override
+    {
+        double t, alpha, beta;
+        return intersect(r, ray_t, t, alpha, beta);
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override
+    {
+        // Uniform sampling over the area, converted to solid angle at "origin".
+        double t, alpha, beta;
+        if(!intersect(ray(origin, direction), interval(0.001, infinity), t, alpha, beta)) return 0;
+
+        auto distance_squared = t * t * direction.length_squared();
+        auto cosine = std::fabs(dot(direction, normal) / direction.length());
+        return cosine > 0 ? distance_squared / (cosine * area) : 0;
+    }
+
+    vec3 random(const point3& origin, double u1, double u2) const override
+    {
+        return Q + (u1 * u) + (u2 * v) - origin;
+    }
+
+private:
+    point3 Q;
+    vec3 u, v;
+    vec3 w;                 // n / dot(n, n), gives the plane coordinates of a point
+    vec3 normal;
+    double D;
+    double area;
+    shared_ptr<material> mat;
+    const material_data* mat_data;
+    aabb bbox;
+
+    bool intersect(const ray& r, interval ray_t, double& t, double& alpha, double& beta) const
+    {
+        // No hit if the ray is parallel to the plane.
+        auto denom = dot(normal, r.direction());
+        if(std::fabs(denom) < 1e-8) return false;
+
+        t = (D - dot(normal, r.origin())) / denom;
+        if(!ray_t.contains(t)) return false;
+
+        // Plane coordinates of the hit point, inside the quad when both are in [0,1].
+        vec3 planar = r.at(t) - Q;
+        alpha = dot(w, cross(planar, v));
+        beta = dot(w, cross(u, planar));
+        return 0 <= alpha && alpha <= 1 && 0 <= beta && beta <= 1;
+    }
+};
+
+class plane : public hittable
+{
+public:
+    // Infinite plane through "point", facing "normal". Its box is the whole space, so it can't
+    // go into a BVH : bvh_node keeps it next to the tree. (split_bvh_outliers)
+    plane(const point3& point, const vec3& normal, shared_ptr<material> mat)
+      : point(point), basis(normal), D(dot(basis.w(), point)), mat(mat), mat_data(&mat->data()) {}
+
+    aabb bounding_box() const override { return aabb::universe; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override
+    {
+        double t;
+        if(!intersect(r, ray_t, t)) return false;
+
+        // Surface coordinates are plane coordinates (unbounded, in world units) from "point".
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.u = dot(rec.p - point, basis.u());
+        rec.v = dot(rec.p - point, basis.v());
+        rec.mat = mat_data;
+        rec.object_id = object_id;
+        rec.set_face_normal(r, basis.w());
+        return true;
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override
+    {
+        double t;
+        return intersect(r, ray_t, t);
+    }
+
+private:
+    point3 point;
+    onb basis;              // w is the unit normal
+    double D;
+    shared_ptr<material> mat;
+    const material_data* mat_data;
+
+    bool intersect(const ray& r, interval ray_t, double& t) const
+    {
+        auto denom = dot(basis.w(), r.direction());
+        if(std::fabs(denom) < 1e-8) return false;
+
+        t = (D - dot(basis.w(), r.origin())) / denom;
+        return ray_t.contains(t);
+    }
+};
+
+#endif
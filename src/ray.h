@@ -7,7 +7,13 @@ public:
     ray() {}
 
     ray(const point3& origin, const vec3& direction, double time) 
-        : orig(origin), dir(direction), tm(time) {}
+        : orig(origin), dir(direction), tm(time) 
+    {
+        // Traversal data, computed once here instead of at every box the ray is tested 
+        // against. A zero component gives an infinite inverse of the same sign. (IEEE)
+        inv_dir = vec3(1 / dir.x(), 1 / dir.y(), 1 / dir.z());
+        for(int axis = 0; axis < 3; axis++) negative[axis] = std::signbit(inv_dir[axis]);
+    }
     ray(const point3& origin, const vec3& direction) 
         : ray(origin, direction, 0) {}  
     // NOTE : can use constructor with init list
@@ -17,6 +23,17 @@ public:
     const vec3& direction() const { return dir; }
     const double time() const { return tm; }
 
+    const vec3& inv_direction() const { return inv_dir; }
+    bool is_negative(int axis) const { return negative[axis]; }  // direction sign, -0 included
+
+    ray with_origin(const point3& origin) const
+    {
+        // Same direction (and traversal data) from another origin.
+        ray moved = *this;
+        moved.orig = origin;
+        return moved;
+    }
+
     point3 at(double t) const
     {
         return orig + t * dir;
@@ -26,6 +43,8 @@ private:
     point3 orig;
     vec3 dir;
     double tm;
+    vec3 inv_dir;
+    bool negative[3];
 };
 
 #endif
\ No newline at end of file
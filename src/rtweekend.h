@@ -21,6 +21,25 @@ inline double degrees_to_radians(double degress)
     return degress * pi / 180.0;
 }
 
+inline std::mt19937& random_generator(int overload)
+{
+    // "thread_local" gives every render thread its own generators, so threads never
+    // race on (or contend for) the generator state. Each random_double() overload draws
+    // from its own one.
+    // Every thread starts from the default seed : scene functions, which run on the main
+    // thread or a fresh one, build the same scene every time. Render pool threads reseed
+    // theirs (seed_random_generators) so they don't all draw the same sequence.
+    static thread_local std::mt19937 generators[2];
+    return generators[overload];
+}
+
+inline void seed_random_generators(unsigned int stream)
+{
+    // Distinct streams for distinct "stream" values, 0 is the default seed.
+    random_generator(0).seed(std::mt19937::default_seed + 2 * stream);
+    random_generator(1).seed(std::mt19937::default_seed + 2 * stream + 1);
+}
+
 inline double random_double()
 {
     // Returns a random real in [0,1)
@@ -28,17 +47,15 @@ inline double random_double()
     // thus, only one init in first call and reused after calles.
     // This makes generated random numbers' consistancy 
     // and have lower overhead.
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    static thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(random_generator(0));
 }
 
 inline double random_double(double min, double max)
 {
     // Returns a random real in [min,max)
     std::uniform_real_distribution<double> distribution(min, max);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return distribution(random_generator(1));
 }
 
 inline int random_int(int min, int max)
@@ -49,6 +66,8 @@ inline int random_int(int min, int max)
 
 // Common headers
 #include "vec3.h"
+#include "fast_math.h"
+#include "sampling.h"
 #include "interval.h"
 #include "color.h"
 #include "ray.h"
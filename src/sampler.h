@@ -0,0 +1,332 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+// Samplers supply the uniform numbers of each camera sample, one "dimension" at a time.
+// A camera sample always consumes its dimensions in the same order :
+//   get_2d : pixel jitter
+//   get_2d : lens (defocus disk)
+//   get_1d : ray time
+//   per bounce, get_scatter (2d direction + 1d decision) and get_2d (light sample)
+// so that low discrepancy sequences line up with the same integrand in every sample.
+// All samplers here are deterministic functions of (seed, pixel, sample index, dimension),
+// so renders are reproducible and pixels can be rendered in any order.
+
+enum class Sampler_type
+{
+    INDEPENDENT,    // hashed uncorrelated numbers, plain Monte Carlo
+    STRATIFIED,     // correlated multi-jittered (Kensler 2013)
+    HALTON,         // Halton sequence, Cranley-Patterson rotated per pixel
+    SOBOL           // Owen scrambled Sobol (Burley 2020), shuffled per pixel and dimension
+};
+
+/* Bit Mixing Utility Functions */
+
+inline uint32_t mix_bits(uint32_t x)
+{
+    // "lowbias32" integer hash. Every input bit affects every output bit.
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t value)
+{
+    return mix_bits(seed ^ (value + 0x9e3779b9U + (seed << 6) + (seed >> 2)));
+}
+
+inline double uint_to_unit(uint32_t x)
+{
+    // [0, 2^32) to [0,1). Never returns 1.
+    return x * (1.0 / 4294967296.0);
+}
+
+inline uint32_t reverse_bits(uint32_t x)
+{
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ffU) << 8) | ((x & 0xff00ff00U) >> 8);
+    x = ((x & 0x0f0f0f0fU) << 4) | ((x & 0xf0f0f0f0U) >> 4);
+    x = ((x & 0x33333333U) << 2) | ((x & 0xccccccccU) >> 2);
+    x = ((x & 0x55555555U) << 1) | ((x & 0xaaaaaaaaU) >> 1);
+    return x;
+}
+
+class sampler
+{
+public:
+    sampler(uint32_t seed) : seed(seed) {}
+
+    virtual ~sampler() = default;
+
+    // Begins sample "sample_index" of pixel (i, j). Dimensions restart from 0.
+    void start_pixel_sample(int i, int j, int sample_index)
+    {
+        pixel_seed = hash_combine(hash_combine(seed, uint32_t(i)), uint32_t(j));
+        index = uint32_t(sample_index);
+        dimension = 0;
+    }
+
+    virtual double get_1d() = 0;
+    virtual void get_2d(double& u1, double& u2) = 0;
+
+    scatter_sample get_scatter()
+    {
+        scatter_sample xi;
+        get_2d(xi.u1, xi.u2);
+        xi.choice = get_1d();
+        return xi;
+    }
+
+    // Samplers keep per-sample state, so every render thread needs its own copy.
+    virtual shared_ptr<sampler> clone() const = 0;
+
+protected:
+    uint32_t seed;
+    uint32_t pixel_seed = 0;
+    uint32_t index = 0;
+    uint32_t dimension = 0;
+
+    uint32_t dimension_seed() const
+    {
+        // Decorrelates pixels and dimensions from each other.
+        return hash_combine(pixel_seed, dimension);
+    }
+};
+
+class independent_sampler : public sampler
+{
+public:
+    independent_sampler(uint32_t seed) : sampler(seed) {}
+
+    double get_1d() override
+    {
+        auto u = uint_to_unit(hash_combine(dimension_seed(), index));
+        dimension++;
+        return u;
+    }
+
+    void get_2d(double& u1, double& u2) override
+    {
+        u1 = get_1d();
+        u2 = get_1d();
+    }
+
+    shared_ptr<sampler> clone() const override { return make_shared<independent_sampler>(*this); }
+};
+
+class stratified_sampler : public sampler
+{
+public:
+    // Stratifies over "samples_per_pixel" strata. 2D dimensions use correlated multi-jittered 
+    // sampling, which works for any sample count, not just perfect squares.
+    // Sample indices beyond the count start a fresh, differently permuted pattern.
+    stratified_sampler(uint32_t seed, int samples_per_pixel) 
+        : sampler(seed), count(uint32_t(samples_per_pixel < 1 ? 1 : samples_per_pixel)) {}
+
+    double get_1d() override
+    {
+        uint32_t s, p;
+        pattern(s, p);
+        auto stratum = permute(s, count, p * 0x68bc21ebU);
+        auto jitter = randfloat(s, p * 0x967a889bU);
+        dimension++;
+        return (stratum + jitter) / count;
+    }
+
+    void get_2d(double& u1, double& u2) override
+    {
+        uint32_t s, p;
+        pattern(s, p);
+
+        // m x n grid covering count cells, Kensler's "cmj" (Pixar technical memo 13-01)
+        uint32_t m = uint32_t(std::sqrt(double(count)));
+        uint32_t n = (count + m - 1) / m;
+
+        s = permute(s, count, p * 0x51633e2dU);
+        auto sx = permute(s % m, m, p * 0x68bc21ebU);
+        auto sy = permute(s / m, n, p * 0x02e5be93U);
+        auto jx = randfloat(s, p * 0x967a889bU);
+        auto jy = randfloat(s, p * 0x368cc8b7U);
+
+        u1 = std::fmin((s % m + (sy + jx) / n) / m, 1 - 1e-16);
+        u2 = std::fmin((s / m + (sx + jy) / m) / n, 1 - 1e-16);
+        dimension++;
+    }
+
+    shared_ptr<sampler> clone() const override { return make_shared<stratified_sampler>(*this); }
+
+private:
+    uint32_t count;
+
+    void pattern(uint32_t& s, uint32_t& p) const
+    {
+        s = index % count;
+        p = hash_combine(dimension_seed(), index / count) | 1;
+    }
+
+    static uint32_t permute(uint32_t i, uint32_t l, uint32_t p)
+    {
+        // Random permutation of [0, l) selected by p, evaluated for element i. 
+        // (cycle walking over the next power of two)
+        if(l <= 1) return 0;
+
+        uint32_t w = l - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+
+        do
+        {
+            i ^= p;             i *= 0xe170893dU;
+            i ^= p >> 16;
+            i ^= (i & w) >> 4;
+            i ^= p >> 8;        i *= 0x0929eb3fU;
+            i ^= p >> 23;
+            i ^= (i & w) >> 1;  i *= 1 | p >> 27;
+                                i *= 0x6935fa69U;
+            i ^= (i & w) >> 11; i *= 0x74dcb303U;
+            i ^= (i & w) >> 2;  i *= 0x9e501cc3U;
+            i ^= (i & w) >> 2;  i *= 0xc860a3dfU;
+            i &= w;
+            i ^= i >> 5;
+        } while (i >= l);
+
+        return (i + p) % l;
+    }
+
+    static double randfloat(uint32_t i, uint32_t p)
+    {
+        return uint_to_unit(hash_combine(p, i));
+    }
+};
+
+class halton_sampler : public sampler
+{
+public:
+    // Dimension d uses the d-th prime as its base. Each pixel and dimension is shifted by its own
+    // random offset (Cranley-Patterson rotation) so neighbouring pixels don't share a pattern.
+    halton_sampler(uint32_t seed) : sampler(seed) {}
+
+    double get_1d() override
+    {
+        static const uint32_t primes[] = {
+            2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+            59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+        };
+        const uint32_t prime_count = sizeof(primes) / sizeof(primes[0]);
+
+        // Deep bounces past the table reuse the bases, decorrelated by the rotation.
+        auto u = radical_inverse(primes[dimension % prime_count], index)
+               + uint_to_unit(dimension_seed());
+        dimension++;
+        u -= std::floor(u);
+        return std::fmin(u, 1 - 1e-16);
+    }
+
+    void get_2d(double& u1, double& u2) override
+    {
+        u1 = get_1d();
+        u2 = get_1d();
+    }
+
+    shared_ptr<sampler> clone() const override { return make_shared<halton_sampler>(*this); }
+
+private:
+    static double radical_inverse(uint32_t base, uint32_t a)
+    {
+        // Mirrors the base "base" digits of a around the radix point.
+        double inv_base = 1.0 / base;
+        double inv_base_n = 1.0;
+        uint32_t reversed = 0;
+        while(a)
+        {
+            uint32_t next = a / base;
+            uint32_t digit = a - next * base;
+            reversed = reversed * base + digit;
+            inv_base_n *= inv_base;
+            a = next;
+            if(reversed >= 0x0fffffffU) break;  // enough precision, avoid overflow
+        }
+        return reversed * inv_base_n;
+    }
+};
+
+class sobol_sampler : public sampler
+{
+public:
+    // Every pair of dimensions is the first two Sobol dimensions, Owen scrambled with a seed of
+    // its own and visited in a per-pixel shuffled order. ("Practical Hash-based Owen Scrambling",
+    // Burley 2020) This keeps the (0,2)-sequence quality of 2D Sobol at every bounce without a
+    // table of high dimensional direction numbers.
+    sobol_sampler(uint32_t seed) : sampler(seed) {}
+
+    double get_1d() override
+    {
+        uint32_t dim_seed = dimension_seed();
+        uint32_t i = nested_uniform_scramble(index, dim_seed);
+        dimension++;
+        return uint_to_unit(nested_uniform_scramble(reverse_bits(i), mix_bits(dim_seed)));
+    }
+
+    void get_2d(double& u1, double& u2) override
+    {
+        uint32_t dim_seed = dimension_seed();
+        uint32_t i = nested_uniform_scramble(index, dim_seed);
+        u1 = uint_to_unit(nested_uniform_scramble(reverse_bits(i), hash_combine(dim_seed, 1)));
+        u2 = uint_to_unit(nested_uniform_scramble(sobol_second_dimension(i), hash_combine(dim_seed, 2)));
+        dimension++;
+    }
+
+    shared_ptr<sampler> clone() const override { return make_shared<sobol_sampler>(*this); }
+
+private:
+    static uint32_t sobol_second_dimension(uint32_t i)
+    {
+        // Generator matrix of the second Sobol dimension (primitive polynomial x + 1).
+        uint32_t v = 1U << 31;
+        uint32_t result = 0;
+        for(; i; i >>= 1, v ^= v >> 1)
+            if(i & 1) result ^= v;
+        return result;
+    }
+
+    static uint32_t laine_karras_permutation(uint32_t x, uint32_t seed)
+    {
+        // Hash in which every bit only depends on the bits below it.
+        x += seed;
+        x ^= x * 0x6c50b47cU;
+        x ^= x * 0xb82f1e52U;
+        x ^= x * 0xc7afe638U;
+        x ^= x * 0x8d22f6e6U;
+        return x;
+    }
+
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed)
+    {
+        // Owen scrambling : each bit is flipped depending on all the bits above it.
+        x = reverse_bits(x);
+        x = laine_karras_permutation(x, seed);
+        x = reverse_bits(x);
+        return x;
+    }
+};
+
+inline shared_ptr<sampler> make_sampler(Sampler_type type, int samples_per_pixel, uint32_t seed)
+{
+    switch(type)
+    {
+        case Sampler_type::INDEPENDENT: return make_shared<independent_sampler>(seed);
+        case Sampler_type::STRATIFIED:  return make_shared<stratified_sampler>(seed, samples_per_pixel);
+        case Sampler_type::HALTON:      return make_shared<halton_sampler>(seed);
+        case Sampler_type::SOBOL:
+        default:                        return make_shared<sobol_sampler>(seed);
+    }
+}
+
+#endif
@@ -0,0 +1,136 @@
+#ifndef SAMPLING_H
+#define SAMPLING_H
+
+// Closed form samplers.
+// Every "sample_*" function maps uniform numbers in [0,1) to a point or direction with no
+// rejection loop, so each sample costs a fixed number of generator calls and no data
+// dependent branches. (the selects below compile to conditional moves)
+// Taking the uniform numbers as arguments lets the caller feed them from any source,
+// and each sampler comes with its pdf so integrators can weight the result.
+// Directions are in a local frame around +z. Map them to world space with an "onb".
+
+inline vec3 sample_uniform_sphere(double u1, double u2)
+{
+    // Uniform direction on the unit sphere. (Archimedes : z is uniform in [-1,1])
+    auto z = 1 - 2*u1;
+    auto r = std::sqrt(std::fmax(0.0, 1 - z*z));
+    double sin_phi, cos_phi;
+    math_sin_cos(2*pi*u2, sin_phi, cos_phi);
+    return vec3(r * cos_phi, r * sin_phi, z);
+}
+
+inline double uniform_sphere_pdf()
+{
+    return 1 / (4*pi);
+}
+
+inline vec3 sample_concentric_disk(double u1, double u2)
+{
+    // Uniform point in the unit disk (z = 0), Shirley-Chiu concentric mapping.
+    // Maps concentric squares to concentric circles, so stratified inputs stay 
+    // well stratified on the disk (unlike the polar sqrt mapping).
+    auto a = 2*u1 - 1;
+    auto b = 2*u2 - 1;
+
+    bool first = std::fabs(a) > std::fabs(b);
+    auto r = first ? a : b;
+    auto phi = first ? (pi/4) * (b / a) : (pi/2) - (pi/4) * (a / b);
+    // a = b = 0 gives 0/0 = NaN in phi, but r = 0 so any angle will do.
+    phi = (r == 0) ? 0 : phi;
+
+    double sin_phi, cos_phi;
+    math_sin_cos(phi, sin_phi, cos_phi);
+    return vec3(r * cos_phi, r * sin_phi, 0);
+}
+
+inline double concentric_disk_pdf()
+{
+    // Area density over the unit disk.
+    return 1 / pi;
+}
+
+inline vec3 sample_cosine_hemisphere(double u1, double u2)
+{
+    // Cosine weighted direction on the +z hemisphere. (Malley's method : project a 
+    // uniform disk point up to the hemisphere)
+    double sin_phi, cos_phi;
+    math_sin_cos(2*pi*u1, sin_phi, cos_phi);
+    auto r = std::sqrt(u2);
+    auto z = std::sqrt(1 - u2);  // > 0 because u2 < 1
+    return vec3(r * cos_phi, r * sin_phi, z);
+}
+
+inline double cosine_hemisphere_pdf(double cos_theta)
+{
+    return cos_theta <= 0 ? 0 : cos_theta / pi;
+}
+
+inline vec3 sample_uniform_cone(double u1, double u2, double cos_theta_max)
+{
+    // Uniform direction over the cone around +z whose angle to +z is at most theta_max. 
+    // (solid angle = 2*pi*(1-cos_theta_max))
+    // Used for sphere light sampling and the fuzzy metal lobe.
+    auto z = 1 + u2*(cos_theta_max - 1);
+    double sin_phi, cos_phi;
+    math_sin_cos(2*pi*u1, sin_phi, cos_phi);
+    auto sin_theta = std::sqrt(std::fmax(0.0, 1 - z*z));
+    return vec3(cos_phi * sin_theta, sin_phi * sin_theta, z);
+}
+
+inline double uniform_cone_pdf(double cos_theta_max)
+{
+    // Solid angle density of sample_uniform_cone() inside the cone.
+    return 1 / (2*pi*(1 - cos_theta_max));
+}
+
+// Uniform numbers a single scattering event may consume : a 2D direction sample (u1, u2)
+// and a 1D decision (choice), e.g. reflect or refract. Filled by a "sampler" when rendering.
+struct scatter_sample
+{
+    double u1, u2, choice;
+
+    static scatter_sample random()
+    {
+        scatter_sample xi;
+        xi.u1 = random_double();
+        xi.u2 = random_double();
+        xi.choice = random_double();
+        return xi;
+    }
+};
+
+/* Random Wrappers */
+// The same samplers driven by random_double().
+
+inline vec3 random_unit_vector()
+{
+    // Used to be a rejection loop over the [-1,1]^3 cube, which needed about 2 tries 
+    // (6 generator calls) on average. See /note/loop count test.cc
+    return sample_uniform_sphere(random_double(), random_double());
+}
+
+inline vec3 random_in_unit_disk()
+{
+    return sample_concentric_disk(random_double(), random_double());
+}
+
+inline vec3 random_cosine_direction()
+{
+    return sample_cosine_hemisphere(random_double(), random_double());
+}
+
+inline vec3 random_cone_direction(double cos_theta_max)
+{
+    return sample_uniform_cone(random_double(), random_double(), cos_theta_max);
+}
+
+// Depreicated at Chapter 9. Replaced with "random_unit_vector()"
+inline vec3 random_on_hemisphere(const vec3& normal)
+{
+    vec3 on_unit_sphere = random_unit_vector();
+    // In the same hemisphere as the normal (pointing out from surface)
+    if(dot(on_unit_sphere, normal) > 0.0) return on_unit_sphere;
+    else return -on_unit_sphere;
+}
+
+#endif
@@ -0,0 +1,115 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include "animation.h"
+#include "arena.h"
+#include "bvh.h"
+#include "camera.h"
+#include "numa.h"
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// A built scene : geometry, lights and the camera that looks at it.
+// Scene functions in main.cc fill one of these, so the same scene can be rendered locally,
+// split into jobs for remote workers, or kept around for more renders.
+class scene
+{
+public:
+    // Owns objects the scene function allocated from it. Declared first, so it's destroyed 
+    // last, after everything that points into it.
+    scene_arena arena;
+
+    hittable_list world;
+    hittable_list lights;   // Emissive objects (also in world) to sample, may be empty
+    camera cam;
+    scene_animation animation;  // Keyframes, renders a sequence when animation.frames > 0
+    std::vector<camera> views;  // Rendered together instead of cam when not empty (camera_rig.h)
+
+    // Copies of this scene on the other NUMA nodes, see replicate_per_node.
+    std::vector<std::unique_ptr<scene>> node_copies;
+
+    const hittable* light_list() const
+    {
+        return lights.objects.empty() ? nullptr : &lights;
+    }
+
+    void render()
+    {
+        if(!views.empty()) camera::render_views(views, world, light_list());
+        else if(lights.objects.empty()) cam.render(world);
+        else cam.render(world, lights);
+    }
+
+    void replicate_per_node(const std::function<void(scene&)>& build)
+    {
+        // Builds the scene again on every NUMA node but the first, each time from a thread
+        // pinned to the node, so the copy's objects, textures and BVH are first touched (and
+        // so placed) in that node's memory. The camera's threads are pinned and trace against
+        // their own node's copy; the light list stays shared, it's small and stays in cache.
+        // Scene functions are deterministic (they draw from the building thread's fresh
+        // generator and number their objects from the thread's fresh id counter), so every
+        // copy is the same scene, down to the object ids. Costs a scene's memory per extra
+        // node, and this scene should itself be built on node 0. (run_on_node)
+        const numa_topology& topology = numa_topology::system();
+        cam.pin_threads = true;
+        cam.node_worlds.assign(1, &world);
+        node_copies.clear();
+        for(int node = 1; node < topology.node_count(); node++)
+        {
+            std::unique_ptr<scene> copy(new scene);
+            run_on_node(node, [&] { build(*copy); });
+            cam.node_worlds.push_back(&copy->world);
+            node_copies.push_back(std::move(copy));
+        }
+    }
+
+    void render_sequence()
+    {
+        // Renders all frames in this process. The scene, its textures and the camera's thread
+        // pool stay alive between frames. Each frame only moves the animated objects and refits
+        // the BVH over the world, the BVH is rebuilt when its nodes have grown by
+        // animation.rebuild_threshold on average since the last build. (bvh_node::refit_growth)
+        using clock = std::chrono::steady_clock;
+
+        shared_ptr<bvh_node> bvh;
+        int rebuilds = 0;
+
+        for(int frame = 0; frame < animation.frames; frame++)
+        {
+            auto update_start = clock::now();
+            animation.set_time(frame * animation.frame_time, cam);
+
+            if(bvh) bvh->refit();
+            if(!bvh || bvh->refit_growth() > animation.rebuild_threshold)
+            {
+                if(bvh) rebuilds++;
+                bvh = make_shared<bvh_node>(world);
+            }
+            lights.refit();
+            std::chrono::duration<double> update_time = clock::now() - update_start;
+
+            char name[32];
+            std::snprintf(name, sizeof(name), "_%04d", frame);
+            cam.output_file = animation.output_prefix + name + ".ppm";
+            cam.aov_prefix = animation.output_prefix + name;
+
+            std::clog << "Frame " << frame + 1 << "/" << animation.frames
+                      << " (scene update " << update_time.count() * 1000 << "ms, bvh growth " 
+                      << bvh->refit_growth() << "x)\n";
+
+            if(lights.objects.empty()) cam.render(*bvh);
+            else cam.render(*bvh, lights);
+        }
+
+        std::clog << "BVH rebuilds after the first frame: " << rebuilds << '\n';
+    }
+};
+
+// Builds the scene with the given name, returns false if there is no such scene.
+typedef bool (*scene_loader)(const std::string& name, scene& scn);
+
+#endif
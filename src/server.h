@@ -0,0 +1,439 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+// Long running render server.
+//
+// Listens for HTTP requests on a local port and renders them with scenes that stay built
+// between requests, so a repeated job on the same scene starts tracing rays immediately
+// instead of rebuilding geometry, reloading textures and rebuilding the BVH.
+//
+//   ./RTinOneWeekend --server <port>
+//   curl "http://localhost:<port>/render?scene=earth&width=800&spp=64" > earth.ppm
+//
+// /render parameters (all but scene are optional, missing ones keep the scene's values) :
+//   scene                       scene name, as on the command line
+//   width, height               image size, height alone keeps the aspect ratio
+//   spp, depth                  samples per pixel, max bounces
+//   lookfrom, lookat            camera position and target, "x,y,z"
+//   vfov, focus_dist, defocus   camera lens
+//   seed                        sampler seed
+//   format                      ppm (default) or pfm (linear float beauty)
+//   priority                    higher runs first, default 0
+// /stats returns the scene cache state.
+//
+// Built scenes live in an LRU cache with a memory cap; a scene is charged with the growth of
+// the process's resident memory while it was built. Jobs wait in a priority queue and run
+// one at a time on a single thread pool shared by all scenes, each job using every thread.
+
+#include "scene.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+    #include <arpa/inet.h>
+    #include <netinet/in.h>
+    #include <sys/socket.h>
+    #include <unistd.h>
+#endif
+
+struct server_settings
+{
+    int     port        = 8080;
+    size_t  cache_bytes = size_t(1) << 30;  // Memory cap of the built scene cache
+    int     threads     = 0;                // Render threads, 0 : one per hardware thread
+};
+
+inline size_t resident_memory_bytes()
+{
+    // Current resident set size, 0 where it can't be read.
+    std::ifstream statm("/proc/self/statm");
+    size_t total_pages = 0, resident_pages = 0;
+    if(!(statm >> total_pages >> resident_pages)) return 0;
+#ifndef _WIN32
+    return resident_pages * size_t(sysconf(_SC_PAGESIZE));
+#else
+    return 0;
+#endif
+}
+
+class scene_cache
+{
+public:
+    scene_cache(size_t capacity_bytes, scene_loader load) : capacity(capacity_bytes), load(load) {}
+
+    shared_ptr<scene> get(const std::string& name, bool& was_cached)
+    {
+        // Returns the built scene, building it (and evicting the least recently used scenes
+        // beyond the memory cap) on a miss. Null if there is no such scene.
+        std::lock_guard<std::mutex> lock(cache_mutex);
+
+        auto found = index.find(name);
+        if(found != index.end())
+        {
+            entries.splice(entries.begin(), entries, found->second);
+            hits++;
+            was_cached = true;
+            return found->second->built;
+        }
+        misses++;
+        was_cached = false;
+
+        // Scene functions draw from the thread local random generator, build on a fresh
+        // thread so a rebuilt scene is the same as the first build (and as the command line).
+        auto built = make_shared<scene>();
+        bool loaded = false;
+        auto before = resident_memory_bytes();
+        std::thread builder([&]() { loaded = load(name, *built); });
+        builder.join();
+        if(!loaded) return nullptr;
+        texture_loads::global().wait();     // Charge the scene with its decoded textures too
+        auto after = resident_memory_bytes();
+
+        entry e;
+        e.name = name;
+        e.built = built;
+        e.bytes = after > before ? after - before : 0;
+        entries.push_front(e);
+        index[name] = entries.begin();
+        total_bytes += e.bytes;
+
+        // Evict from the back, but always keep the scene that was just built.
+        while(total_bytes > capacity && entries.size() > 1)
+        {
+            total_bytes -= entries.back().bytes;
+            index.erase(entries.back().name);
+            entries.pop_back();
+            evictions++;
+        }
+        return built;
+    }
+
+    std::string stats()
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        std::ostringstream out;
+        out << "scenes " << entries.size() << "\nbytes " << total_bytes << "\ncapacity " << capacity
+            << "\nhits " << hits << "\nmisses " << misses << "\nevictions " << evictions << '\n';
+        for(const auto& e : entries) out << "scene " << e.name << ' ' << e.bytes << '\n';
+        return out.str();
+    }
+
+private:
+    struct entry
+    {
+        std::string name;
+        shared_ptr<scene> built;    // Jobs in flight keep an evicted scene alive
+        size_t bytes;
+    };
+
+    size_t capacity;
+    scene_loader load;
+    std::mutex cache_mutex;
+    std::list<entry> entries;       // Most recently used first
+    std::map<std::string, std::list<entry>::iterator> index;
+    size_t total_bytes = 0;
+    long hits = 0, misses = 0, evictions = 0;
+};
+
+namespace http
+{
+    inline std::map<std::string, std::string> parse_query(const std::string& query)
+    {
+        // "a=1&b=2" -> {a:1, b:2}, "%2C" style escapes decoded.
+        std::map<std::string, std::string> params;
+        std::istringstream in(query);
+        std::string pair;
+        while(std::getline(in, pair, '&'))
+        {
+            auto eq = pair.find('=');
+            std::string key = pair.substr(0, eq);
+            std::string raw = eq == std::string::npos ? "" : pair.substr(eq + 1);
+            std::string value;
+            for(size_t k = 0; k < raw.size(); k++)
+            {
+                if(raw[k] == '%' && k + 2 < raw.size())
+                {
+                    value += char(std::strtol(raw.substr(k + 1, 2).c_str(), nullptr, 16));
+                    k += 2;
+                }
+                else value += raw[k] == '+' ? ' ' : raw[k];
+            }
+            params[key] = value;
+        }
+        return params;
+    }
+
+    inline bool parse_vec3(const std::string& text, vec3& out)
+    {
+        double x, y, z;
+        char c1, c2;
+        std::istringstream in(text);
+        if(!(in >> x >> c1 >> y >> c2 >> z) || c1 != ',' || c2 != ',') return false;
+        out = vec3(x, y, z);
+        return true;
+    }
+
+    inline std::string response(
+        int status, const std::string& reason, const std::string& content_type, const std::string& body,
+        const std::string& extra_headers = ""
+    )
+    {
+        std::ostringstream out;
+        out << "HTTP/1.0 " << status << ' ' << reason << "\r\n"
+            << "Content-Type: " << content_type << "\r\n"
+            << "Content-Length: " << body.size() << "\r\n"
+            << extra_headers
+            << "Connection: close\r\n\r\n"
+            << body;
+        return out.str();
+    }
+}
+
+class render_server
+{
+public:
+    render_server(const server_settings& settings, scene_loader load)
+      : settings(settings), cache(settings.cache_bytes, load),
+        pool(make_shared<thread_pool>(settings.threads)) {}
+
+    std::string handle(const std::string& request_line)
+    {
+        // Answers one request, e.g. "GET /render?scene=earth&spp=10 HTTP/1.1".
+        // Called from connection threads; renders are queued and run by run_jobs().
+        std::istringstream in(request_line);
+        std::string method, target;
+        in >> method >> target;
+        if(method != "GET") return http::response(405, "Method Not Allowed", "text/plain", "GET only\n");
+
+        auto question = target.find('?');
+        auto path = target.substr(0, question);
+        auto params = http::parse_query(question == std::string::npos ? "" : target.substr(question + 1));
+
+        if(path == "/stats") return http::response(200, "OK", "text/plain", cache.stats());
+        if(path != "/render") return http::response(404, "Not Found", "text/plain", "Try /render or /stats\n");
+        if(params.count("scene") == 0)
+            return http::response(400, "Bad Request", "text/plain", "Missing scene\n");
+
+        auto job = std::make_shared<render_request>();
+        job->params = params;
+        job->priority = params.count("priority") ? std::atoi(params["priority"].c_str()) : 0;
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            job->order = next_order++;
+            queue.push(job);
+        }
+        queue_ready.notify_one();
+
+        std::unique_lock<std::mutex> lock(job->done_mutex);
+        job->done_ready.wait(lock, [&]() { return job->done; });
+        return job->reply;
+    }
+
+    void run_jobs()
+    {
+        // Render loop : highest priority first, first come first served within a priority.
+        for(;;)
+        {
+            shared_ptr<render_request> job;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [&]() { return !queue.empty(); });
+                job = queue.top();
+                queue.pop();
+            }
+
+            auto reply = render(job->params);
+            {
+                std::lock_guard<std::mutex> lock(job->done_mutex);
+                job->reply = reply;
+                job->done = true;
+            }
+            job->done_ready.notify_all();
+        }
+    }
+
+private:
+    struct render_request
+    {
+        std::map<std::string, std::string> params;
+        int priority = 0;
+        long order = 0;
+        std::string reply;
+        bool done = false;
+        std::mutex done_mutex;
+        std::condition_variable done_ready;
+    };
+
+    struct lower_priority
+    {
+        bool operator()(const shared_ptr<render_request>& a, const shared_ptr<render_request>& b) const
+        {
+            if(a->priority != b->priority) return a->priority < b->priority;
+            return a->order > b->order;
+        }
+    };
+
+    server_settings settings;
+    scene_cache cache;
+    shared_ptr<thread_pool> pool;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::priority_queue<shared_ptr<render_request>, std::vector<shared_ptr<render_request>>, lower_priority> queue;
+    long next_order = 0;
+
+    std::string render(std::map<std::string, std::string>& params)
+    {
+        using clock = std::chrono::steady_clock;
+        auto start = clock::now();
+
+        bool was_cached;
+        auto built = cache.get(params["scene"], was_cached);
+        if(!built) return http::response(404, "Not Found", "text/plain", "Unknown scene\n");
+        std::chrono::duration<double> setup_time = clock::now() - start;
+
+        // The cached scene's camera is the template, overrides go on a copy.
+        camera cam = built->cam;
+        cam.share_thread_pool(pool);
+
+        auto number = [&](const char* key, double& value)
+        {
+            if(params.count(key)) value = std::atof(params[key].c_str());
+        };
+        auto integer = [&](const char* key, int& value)
+        {
+            if(params.count(key)) value = std::max(1, std::atoi(params[key].c_str()));
+        };
+
+        integer("width", cam.image_width);
+        if(params.count("height"))
+        {
+            int height = std::max(1, std::atoi(params["height"].c_str()));
+            if(params.count("width")) cam.aspect_ratio = double(cam.image_width) / height;
+            else cam.image_width = std::max(1, int(height * cam.aspect_ratio));
+        }
+        integer("spp", cam.samples_per_pixel);
+        integer("depth", cam.max_depth);
+        number("vfov", cam.vfov);
+        number("focus_dist", cam.focus_dist);
+        number("defocus", cam.defocus_angle);
+        if(params.count("seed")) cam.seed = uint32_t(std::strtoul(params["seed"].c_str(), nullptr, 10));
+        if(params.count("lookfrom") && !http::parse_vec3(params["lookfrom"], cam.lookfrom))
+            return http::response(400, "Bad Request", "text/plain", "lookfrom must be x,y,z\n");
+        if(params.count("lookat") && !http::parse_vec3(params["lookat"], cam.lookat))
+            return http::response(400, "Bad Request", "text/plain", "lookat must be x,y,z\n");
+
+        std::string format = params.count("format") ? params["format"] : "ppm";
+        if(format != "ppm" && format != "pfm")
+            return http::response(400, "Bad Request", "text/plain", "format must be ppm or pfm\n");
+
+        cam.initialize();
+        render_job_desc whole;
+        whole.x1 = cam.image_width;
+        whole.y1 = cam.height();
+        whole.sample_end = cam.samples_per_pixel;
+        auto fb = cam.render_job(built->world, built->light_list(), whole);
+        cam.postprocess(fb);
+        std::chrono::duration<double> total_time = clock::now() - start;
+
+        std::ostringstream body;
+        if(format == "ppm") fb.write_ppm(body);
+        else fb.write_pfm(body, Aov::BEAUTY);
+
+        std::ostringstream headers;
+        headers << "X-Scene-Cache: " << (was_cached ? "hit" : "miss") << "\r\n"
+                << "X-Setup-Seconds: " << setup_time.count() << "\r\n"
+                << "X-Render-Seconds: " << total_time.count() << "\r\n";
+
+        std::clog << "Rendered " << params["scene"] << ' ' << fb.width << 'x' << fb.height
+                  << " (" << (was_cached ? "cached" : "built") << ", setup " << setup_time.count()
+                  << "s, total " << total_time.count() << "s)\n";
+
+        auto content_type = format == "ppm" ? "image/x-portable-pixmap" : "application/octet-stream";
+        return http::response(200, "OK", content_type, body.str(), headers.str());
+    }
+};
+
+#ifndef _WIN32
+
+inline int run_server(const server_settings& settings, scene_loader load)
+{
+    int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);     // Local clients only
+    addr.sin_port = htons(uint16_t(settings.port));
+    if(listen_fd < 0 || ::bind(listen_fd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(listen_fd, 64) != 0)
+    {
+        std::cerr << "ERROR : Could not listen on port " << settings.port << ".\n";
+        if(listen_fd >= 0) close(listen_fd);
+        return 1;
+    }
+    std::clog << "Render server listening on port " << settings.port << ".\n";
+
+    render_server server(settings, load);
+    std::thread renderer([&]() { server.run_jobs(); });
+    renderer.detach();
+
+    for(;;)
+    {
+        int fd = ::accept(listen_fd, nullptr, nullptr);
+        if(fd < 0) continue;
+
+        // One thread per connection, it mostly waits for its job in the queue.
+        std::thread([&server, fd]()
+        {
+            std::string request;
+            char chunk[4096];
+            while(request.find("\r\n\r\n") == std::string::npos && request.size() < 65536)
+            {
+                auto n = ::recv(fd, chunk, sizeof(chunk), 0);
+                if(n <= 0) break;
+                request.append(chunk, size_t(n));
+            }
+
+            auto line_end = request.find("\r\n");
+            if(line_end != std::string::npos)
+            {
+                auto reply = server.handle(request.substr(0, line_end));
+                size_t sent = 0;
+                while(sent < reply.size())
+                {
+                    auto n = ::send(fd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+                    if(n <= 0) break;
+                    sent += size_t(n);
+                }
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+#else
+
+inline int run_server(const server_settings&, scene_loader)
+{
+    std::cerr << "ERROR : The render server is not supported on this platform.\n";
+    return 1;
+}
+
+#endif
+
+#endif
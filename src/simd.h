@@ -0,0 +1,90 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Small portable SIMD layer for vec3 and the batched vec3x4 / vec3x8 types.
+//
+// double4 holds 4 doubles : one AVX register when the compiler targets AVX (-mavx,
+// -march=native), two SSE2 registers on any other x86-64, and a plain array elsewhere.
+// The operations are kept to what vec3 needs : lane-wise arithmetic, and the lane shuffles
+// for cross products.
+//
+// Compiled in only with RT_SIMD (cmake -DRT_SIMD=ON). Without it vec3 stays the scalar
+// 3-double class and nothing here is used.
+
+#if defined(__AVX__)
+    #include <immintrin.h>
+    #define RT_SIMD_AVX 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define RT_SIMD_SSE2 1
+#endif
+
+struct double4
+{
+#if defined(RT_SIMD_AVX)
+    __m256d v;
+
+    static double4 load(const double* p) { return double4{ _mm256_loadu_pd(p) }; }
+    void store(double* p) const { _mm256_storeu_pd(p, v); }
+    static double4 splat(double x) { return double4{ _mm256_set1_pd(x) }; }
+
+    friend double4 operator+(double4 a, double4 b) { return double4{ _mm256_add_pd(a.v, b.v) }; }
+    friend double4 operator-(double4 a, double4 b) { return double4{ _mm256_sub_pd(a.v, b.v) }; }
+    friend double4 operator*(double4 a, double4 b) { return double4{ _mm256_mul_pd(a.v, b.v) }; }
+    friend double4 operator/(double4 a, double4 b) { return double4{ _mm256_div_pd(a.v, b.v) }; }
+    friend double4 min(double4 a, double4 b) { return double4{ _mm256_min_pd(a.v, b.v) }; }
+    friend double4 max(double4 a, double4 b) { return double4{ _mm256_max_pd(a.v, b.v) }; }
+
+    // (x, y, z, w) -> (y, z, x, w) and (z, x, y, w), the two rotations of a cross product.
+#if defined(__AVX2__)
+    double4 yzx() const { return double4{ _mm256_permute4x64_pd(v, 0xC9) }; }
+    double4 zxy() const { return double4{ _mm256_permute4x64_pd(v, 0xD2) }; }
+#else
+    double4 yzx() const
+    {
+        // No cross-lane permute before AVX2 : swap the halves, blend, then shuffle in lane.
+        __m256d swapped = _mm256_permute2f128_pd(v, v, 0x01);     // (z, w, x, y)
+        __m256d a = _mm256_blend_pd(v, swapped, 0x4);               // (x, y, x, w)
+        __m256d b = _mm256_blend_pd(v, swapped, 0x1);               // (z, y, z, w)
+        return double4{ _mm256_shuffle_pd(a, b, 0x9) };             // (y, z, x, w)
+    }
+    double4 zxy() const { return yzx().yzx(); }
+#endif
+#elif defined(RT_SIMD_SSE2)
+    __m128d lo, hi;     // lanes 0,1 and 2,3
+
+    static double4 load(const double* p) { return double4{ _mm_loadu_pd(p), _mm_loadu_pd(p + 2) }; }
+    void store(double* p) const { _mm_storeu_pd(p, lo); _mm_storeu_pd(p + 2, hi); }
+    static double4 splat(double x) { return double4{ _mm_set1_pd(x), _mm_set1_pd(x) }; }
+
+    friend double4 operator+(double4 a, double4 b) { return double4{ _mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi) }; }
+    friend double4 operator-(double4 a, double4 b) { return double4{ _mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi) }; }
+    friend double4 operator*(double4 a, double4 b) { return double4{ _mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi) }; }
+    friend double4 operator/(double4 a, double4 b) { return double4{ _mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi) }; }
+    friend double4 min(double4 a, double4 b) { return double4{ _mm_min_pd(a.lo, b.lo), _mm_min_pd(a.hi, b.hi) }; }
+    friend double4 max(double4 a, double4 b) { return double4{ _mm_max_pd(a.lo, b.lo), _mm_max_pd(a.hi, b.hi) }; }
+
+    // (x, y, z, w) -> (y, z, x, w) and (z, x, y, w), the two rotations of a cross product.
+    double4 yzx() const { return double4{ _mm_shuffle_pd(lo, hi, 1), _mm_shuffle_pd(lo, hi, 2) }; }
+    double4 zxy() const { return double4{ _mm_shuffle_pd(hi, lo, 0), _mm_shuffle_pd(lo, hi, 3) }; }
+#else
+    double v[4];
+
+    static double4 load(const double* p) { return double4{ { p[0], p[1], p[2], p[3] } }; }
+    void store(double* p) const { for(int k = 0; k < 4; k++) p[k] = v[k]; }
+    static double4 splat(double x) { return double4{ { x, x, x, x } }; }
+
+    friend double4 operator+(double4 a, double4 b) { for(int k = 0; k < 4; k++) a.v[k] += b.v[k]; return a; }
+    friend double4 operator-(double4 a, double4 b) { for(int k = 0; k < 4; k++) a.v[k] -= b.v[k]; return a; }
+    friend double4 operator*(double4 a, double4 b) { for(int k = 0; k < 4; k++) a.v[k] *= b.v[k]; return a; }
+    friend double4 operator/(double4 a, double4 b) { for(int k = 0; k < 4; k++) a.v[k] /= b.v[k]; return a; }
+    friend double4 min(double4 a, double4 b) { for(int k = 0; k < 4; k++) a.v[k] = a.v[k] < b.v[k] ? a.v[k] : b.v[k]; return a; }
+    friend double4 max(double4 a, double4 b) { for(int k = 0; k < 4; k++) a.v[k] = a.v[k] > b.v[k] ? a.v[k] : b.v[k]; return a; }
+
+    // (x, y, z, w) -> (y, z, x, w) and (z, x, y, w), the two rotations of a cross product.
+    double4 yzx() const { return double4{ { v[1], v[2], v[0], v[3] } }; }
+    double4 zxy() const { return double4{ { v[2], v[0], v[1], v[3] } }; }
+#endif
+};
+
+#endif
@@ -2,38 +2,100 @@
 #define SPHERE_H
 
 #include "hittable.h"
+#include "material.h"
+#include "onb.h"
 
+// Most spheres of a scene are stationary, so a sphere keeps only its center and precomputed
+// radius terms, and derives its bounding box on demand instead of storing it. A moving sphere
+// (center1 at time 0 to center2 at time 1) keeps its motion out of line, behind a pointer that
+// is null for the stationary ones : their hit test doesn't evaluate a motion ray.
 class sphere : public hittable
 {
 public:
     // Stationary Sphere
     sphere(const point3& static_center, double radius, shared_ptr<material> mat)
-    : center(static_center, vec3(0,0,0)), radius(std::fmax(0,radius)), mat(mat) 
-    {
-        auto rvec = vec3(radius, radius, radius);
-        bbox = aabb(static_center - rvec, static_center + rvec);
-    }
+      : needs_uv(material_needs_uv(mat->data())), center(static_center), radius(std::fmax(0,radius)),
+        radius_squared(this->radius * this->radius), inv_radius(this->radius > 0 ? 1 / this->radius : 0),
+        mat_data(&mat->data()), mat(mat)
+    {}
     // clamps radius range to [0,radius]
 
     // Moving Sphere
     sphere(const point3& center1, const point3& center2, double radius, shared_ptr<material> mat)
-      : center(center1, center2 - center1), radius(std::fmax(0,radius)), mat(mat) 
+      : sphere(center1, radius, mat)
     {
-        auto rvec = vec3(radius, radius, radius);
-        aabb box1(center.at(0) - rvec, center.at(0) + rvec);
-        aabb box2(center.at(1) - rvec, center.at(1) + rvec);
-        bbox = aabb(box1, box2);
+        vec3 offset = center2 - center1;
+        if(offset.length_squared() > 0) motion.reset(new vec3(offset));
     }
 
-    aabb bounding_box() const override { return bbox; }
+    aabb bounding_box() const override
+    {
+        if(!motion) return box_at(center);
+        return aabb(box_at(center), box_at(center + *motion));
+    }
+
+    bool is_moving() const override { return motion != nullptr; }
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override
     {
-        point3 current_center = center.at(r.time());
+        if(!motion) return hit_at(center, r, ray_t, rec);
+        return hit_at(center + r.time() * *motion, r, ray_t, rec);
+    }
+
+    bool occluded(const ray& r, interval ray_t) const override
+    {
+        if(!motion) return occluded_at(center, r, ray_t);
+        return occluded_at(center + r.time() * *motion, r, ray_t);
+    }
+
+    double pdf_value(const point3& origin, const vec3& direction) const override
+    {
+        // This method only works for stationary spheres. (moving ones are sampled at time 0)
+        hit_record rec;
+        if(!this->hit(ray(origin, direction), interval(0.001, infinity), rec)) return 0;
+
+        auto dist_squared = (center - origin).length_squared();
+        if(dist_squared <= radius_squared) return 0;  // origin inside the sphere, no cone
+
+        auto cos_theta_max = std::sqrt(1 - radius_squared/dist_squared);
+        return uniform_cone_pdf(cos_theta_max);
+    }
+
+    vec3 random(const point3& origin, double u1, double u2) const override
+    {
+        // Uniformly sample the cone of directions the sphere subtends from "origin".
+        vec3 direction = center - origin;
+        auto dist_squared = direction.length_squared();
+        if(dist_squared <= radius_squared) return sample_uniform_sphere(u1, u2);
+
+        onb uvw(direction);
+        auto cos_theta_max = std::sqrt(1 - radius_squared/dist_squared);
+        return uvw.transform(sample_uniform_cone(u1, u2, cos_theta_max));
+    }
+
+private:
+    // First, so it fills the padding after hittable::object_id.
+    bool needs_uv;                  // The material reads u, v (decided once, at construction)
+    point3 center;                  // Center at time 0
+    std::unique_ptr<const vec3> motion;     // center2 - center1, null for stationary spheres
+    double radius;
+    double radius_squared;
+    double inv_radius;              // Normals are scaled by it instead of divided by the radius
+    const material_data* mat_data;  // hit records carry this raw pointer, no refcount traffic
+    shared_ptr<material> mat;
+
+    aabb box_at(const point3& c) const
+    {
+        auto rvec = vec3(radius, radius, radius);
+        return aabb(c - rvec, c + rvec);
+    }
+
+    bool hit_at(const point3& current_center, const ray& r, interval ray_t, hit_record& rec) const
+    {
         vec3 oc = current_center - r.origin();
         auto a = dot(r.direction(), r.direction());
         auto h = dot(r.direction(), oc);
-        auto c = dot(oc, oc) - radius * radius;
+        auto c = dot(oc, oc) - radius_squared;
 
         double discriminant = h*h - a*c;
         if(discriminant < 0) return false;
@@ -52,20 +114,32 @@ public:
         rec.t = root;
         rec.p = r.at(root);
         // normal is unit vector
-        // simply divide with radius value instead using unit_vector function.
-        vec3 outward_normal = (rec.p - current_center) / radius;
+        // simply scale by 1/radius instead using unit_vector function.
+        vec3 outward_normal = (rec.p - current_center) * inv_radius;
         rec.set_face_normal(r, outward_normal);
-        get_sphere_uv(outward_normal, rec.u, rec.v);
-        rec.mat = mat;
+        // Surface coordinates (two inverse trig calls) only for textured materials.
+        if(needs_uv) get_sphere_uv(outward_normal, rec.u, rec.v);
+        else rec.u = rec.v = 0;
+        rec.mat = mat_data;
+        rec.object_id = object_id;
 
         return true;
     }
 
-private:
-    ray center;
-    double radius;
-    shared_ptr<material> mat;
-    aabb bbox;
+    bool occluded_at(const point3& current_center, const ray& r, interval ray_t) const
+    {
+        // hit_at() without the hit point, normal and surface coordinates.
+        vec3 oc = current_center - r.origin();
+        auto a = dot(r.direction(), r.direction());
+        auto h = dot(r.direction(), oc);
+        auto c = dot(oc, oc) - radius_squared;
+
+        double discriminant = h*h - a*c;
+        if(discriminant < 0) return false;
+
+        auto sqrtd = std::sqrt(discriminant);
+        return ray_t.contains((h - sqrtd) / a) || ray_t.contains((h + sqrtd) / a);
+    }
 
     static void get_sphere_uv(const point3& p, double& u, double& v)
     {
@@ -77,8 +151,8 @@ private:
         // <0 1 0> : <0.5 1.0>  < 0 -1  0> : <0.50 0.00>
         // <0 0 1> : <0.5 0.5>  < 0  0 -1> : <0.50 0.50>
 
-        auto theta = std::acos(-p.y());
-        auto phi = std::atan2(-p.z(), p.x()) + pi;
+        auto theta = math_acos(-p.y());
+        auto phi = math_atan2(-p.z(), p.x()) + pi;
 
         u = phi / (2*pi);
         v = theta / pi;
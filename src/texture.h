@@ -2,33 +2,207 @@
 #define TEXTURE_H
 
 #include "rtw_stb_image.h"
+#include "texture_cache.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+class texture;  // forward declaration
+
+// Flattened (tagged) representation of a texture.
+// The polymorphic texture classes below are kept as the authoring API, but each of them
+// fills one of these plain structs at construction time. The render hot path reads only
+// this struct and evaluates it with a switch (see texture_value()), so there is no
+// virtual call and, for solid colors and checkers of solid colors, no pointer chasing.
+struct texture_data
+{
+    enum class kind
+    {
+        SOLID,          // constant color (color0)
+        CHECKER_SOLID,  // checker of two constant colors (color0 : even, color1 : odd)
+        CHECKER,        // checker of two arbitrary textures (even, odd)
+        IMAGE,          // image lookup (image)
+        TILED_IMAGE,    // image lookup paged in through the texture cache (tiled)
+        CUSTOM          // user defined texture, falls back to the virtual value()
+    };
+
+    kind type = kind::CUSTOM;
+    color color0;
+    color color1;
+    double inv_scale = 1.0;
+    const texture_data* even = nullptr;
+    const texture_data* odd = nullptr;
+    const rtw_image* image = nullptr;
+    const tiled_image* tiled = nullptr;
+    const texture* custom = nullptr;
+    const std::atomic<bool>* ready = nullptr;   // Image still loading while false, null : always ready
+};
+
+// Image textures decode in the background (see image_texture), so the rest of the scene and
+// its BVH build while the files load, and rendering can start before they're done.
+class texture_loads
+{
+public:
+    static texture_loads& global()
+    {
+        static texture_loads loads;
+        return loads;
+    }
+
+    void begin()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        pending++;
+    }
+
+    void end()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending--;
+        }
+        done.notify_all();
+    }
+
+    // Blocks until every load started so far has finished.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    std::mutex mutex;
+    std::condition_variable done;
+    int pending = 0;
+};
+
+// Set on the calling thread when texture_value was asked for an image that's still loading
+// and returned black in its place. Whatever was rendered since the flag was cleared is wrong
+// and has to be rendered again once the loads are done. (camera::render_image)
+inline bool& texture_pending()
+{
+    static thread_local bool pending = false;
+    return pending;
+}
 
 class texture
 {   
 public:
+    // Textures that don't flatten themselves stay CUSTOM and are called virtually.
+    texture() { flat.custom = this; }
+
     virtual ~texture() = default;
 
+    // Texture objects are referenced by address from their flattened data.
+    texture(const texture&) = delete;
+    texture& operator=(const texture&) = delete;
+
     virtual color value(double u, double v, const point3& p) const = 0;
     // u,v are texture coordinates
     // p is the point in 3D space
     // returns a color value
+
+    const texture_data& data() const { return flat; }
+
+protected:
+    texture_data flat;
 };
 
+inline color texture_value(const texture_data& tex, double u, double v, const point3& p)
+{
+    switch(tex.type)
+    {
+        case texture_data::kind::SOLID:
+            return tex.color0;
+
+        case texture_data::kind::CHECKER_SOLID:
+        case texture_data::kind::CHECKER:
+        {
+            // Convert and scale 3d point to integer values
+            auto xInteger = static_cast<int>(std::floor(tex.inv_scale * p.x()));
+            auto yInteger = static_cast<int>(std::floor(tex.inv_scale * p.y()));
+            auto zInteger = static_cast<int>(std::floor(tex.inv_scale * p.z()));
+
+            // Check Integer sum is even/odd
+            bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
+
+            if(tex.type == texture_data::kind::CHECKER_SOLID)
+                return isEven ? tex.color0 : tex.color1;
+            return texture_value(isEven ? *tex.even : *tex.odd, u, v, p);
+        }
+
+        case texture_data::kind::IMAGE:
+        {
+            if(tex.ready && !tex.ready->load(std::memory_order_acquire))
+            {
+                texture_pending() = true;
+                return color(0,0,0);
+            }
+            const rtw_image& image = *tex.image;
+
+            // If we have no texture data, then return solid cyan as a debugging aid.
+            if (image.height() <= 0) return color(0,1,1);
+
+            // Clamp input texture coordinates to [0,1] x [1,0]
+            u = interval(0,1).clamp(u);
+            v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
+
+            auto i = int(u * image.width());
+            auto j = int(v * image.height());
+            auto pixel = image.pixel_data(i,j);
+
+            auto color_scale = 1.0 / 255.0;
+            return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+        }
+
+        case texture_data::kind::TILED_IMAGE:
+        {
+            // Same mapping as IMAGE, from the full resolution level.
+            if(tex.ready && !tex.ready->load(std::memory_order_acquire))
+            {
+                texture_pending() = true;
+                return color(0,0,0);
+            }
+            const tiled_image& image = *tex.tiled;
+            if (image.height() <= 0) return color(0,1,1);
+
+            u = interval(0,1).clamp(u);
+            v = 1.0 - interval(0,1).clamp(v);
+
+            auto i = int(u * image.width());
+            auto j = int(v * image.height());
+            unsigned char pixel[3];
+            image.pixel_data(i, j, 0, pixel);
+
+            auto color_scale = 1.0 / 255.0;
+            return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+        }
+
+        case texture_data::kind::CUSTOM:
+        default:
+            return tex.custom->value(u, v, p);
+    }
+}
+
 class solid_color : public texture
 // texture with a single color - albedo (or rgb value that calls delgating constructor)
 {
 public:
-    solid_color(const color& albedo) : albedo(albedo) {}
+    solid_color(const color& albedo)
+    {
+        flat.type = texture_data::kind::SOLID;
+        flat.color0 = albedo;
+    }
 
     solid_color(double red, double green, double blue) : solid_color(color(red,green,blue)) {}
 
     color value(double u, double v, const point3& p) const override
     {
-        return albedo;
+        return flat.color0;
     }
-
-private:
-    color albedo;
 };
 
 class checker_texture : public texture
@@ -36,55 +210,92 @@ class checker_texture : public texture
 public:
     // Takes two textures as input and scale
     checker_texture(double scale, shared_ptr<texture> even, shared_ptr<texture> odd)
-        : inv_scale(1.0/scale), even(even), odd(odd) {}
+        : even(even), odd(odd) 
+    {
+        flat.inv_scale = 1.0/scale;
+
+        // Checkers of two solid colors are flattened into a single struct at build time,
+        // so evaluating them never touches the child textures.
+        const texture_data& e = even->data();
+        const texture_data& o = odd->data();
+        if(e.type == texture_data::kind::SOLID && o.type == texture_data::kind::SOLID)
+        {
+            flat.type = texture_data::kind::CHECKER_SOLID;
+            flat.color0 = e.color0;
+            flat.color1 = o.color0;
+        }
+        else
+        {
+            flat.type = texture_data::kind::CHECKER;
+            flat.even = &e;
+            flat.odd = &o;
+        }
+    }
     
-    // Takes two colors as input and scale (calles delgating constructor by making color to solid_color texture)
+    // Takes two colors as input and scale. Flattened directly, without child solid_color textures.
     checker_texture(double scale, const color& c1, const color& c2)
-        : checker_texture(scale, make_shared<solid_color>(c1), make_shared<solid_color>(c2)) {}
+    {
+        flat.inv_scale = 1.0/scale;
+        flat.type = texture_data::kind::CHECKER_SOLID;
+        flat.color0 = c1;
+        flat.color1 = c2;
+    }
 
     color value(double u, double v, const point3& p) const override
     {
-        // Convert and scale 3d point to integer values
-        auto xInteger = static_cast<int>(std::floor(inv_scale * p.x()));
-        auto yInteger = static_cast<int>(std::floor(inv_scale * p.y()));
-        auto zInteger = static_cast<int>(std::floor(inv_scale * p.z()));
-
-        // Check Integer sum is even/odd
-        bool isEven = (xInteger + yInteger + zInteger) % 2 == 0;
-
-        // 
-        return isEven ? even->value(u, v, p) : odd->value(u, v, p);
+        return texture_value(flat, u, v, p);
     }
 
 private:
-    double inv_scale;
+    // Keeps the child textures (and so their flattened data) alive.
     shared_ptr<texture> even;
     shared_ptr<texture> odd;
 };
 
 class image_texture : public texture {
 public:
-    image_texture(std::string filename) : image(filename.c_str()) {}
-
-    color value(double u, double v, const point3& p) const override 
+    image_texture(std::string filename)
     {
-        // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return color(0,1,1);
+        // Streamed from a tiled file when the texture cache is enabled, decoded into memory
+        // otherwise. Either way the file is opened (and decoded, or converted) on a thread of 
+        // its own, and flat.ready is set when the image can be read.
+        bool streamed = texture_cache::global().enabled();
+        flat.type = streamed ? texture_data::kind::TILED_IMAGE : texture_data::kind::IMAGE;
+        flat.ready = &ready;
 
-        // Clamp input texture coordinates to [0,1] x [1,0]
-        u = interval(0,1).clamp(u);
-        v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
+        texture_loads::global().begin();
+        loader = std::thread([this, filename, streamed]
+        {
+            if(streamed)
+            {
+                tiled.reset(new tiled_image(filename));
+                flat.tiled = tiled.get();
+            }
+            else
+            {
+                image.reset(new rtw_image(filename.c_str()));
+                flat.image = image.get();
+            }
+            ready.store(true, std::memory_order_release);
+            texture_loads::global().end();
+        });
+    }
 
-        auto i = int(u * image.width());
-        auto j = int(v * image.height());
-        auto pixel = image.pixel_data(i,j);
+    ~image_texture()
+    {
+        loader.join();
+    }
 
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+    color value(double u, double v, const point3& p) const override 
+    {
+        return texture_value(flat, u, v, p);
     }
 
 private:
-    rtw_image image;
+    std::unique_ptr<rtw_image> image;
+    std::unique_ptr<tiled_image> tiled;
+    std::atomic<bool> ready{false};
+    std::thread loader;
 };
 
 #endif
@@ -0,0 +1,415 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+// Out-of-core image textures.
+//
+// When the cache is enabled (texture_cache::global().enable(budget), "--texture-cache MB" on
+// the command line), image_texture doesn't decode its image into memory. The image is
+// converted once into a tiled file in tile_directory ("<name>.rtt"), later renders open that
+// file directly. The file holds the whole mip chain (level 0 is the full image, each level
+// halves the previous one), each level cut into tile_size x tile_size RGB tiles :
+//
+//   tiled_image_header
+//   tiled_image_level[levels]
+//   tiles, level by level, row major, 3 * tile_size^2 bytes each (edges padded by clamping)
+//
+// Texel lookups page tiles in on demand through one process wide cache. The cache is split
+// into shards (one mutex each, picked by the tile) so threads rarely wait for each other, and
+// keeps at most budget bytes of tiles, evicting the least recently used ones. Every thread
+// also holds on to the last tile it used, so consecutive lookups in the same tile don't touch
+// the cache at all. (RSS is bounded by the budget plus one tile per thread)
+//
+// Delete tile_directory to convert the images again.
+
+#include "rtw_stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+    #include <sys/stat.h>
+#else
+    #include <direct.h>
+#endif
+
+struct tiled_image_header
+{
+    char     magic[4];      // "RTTX"
+    uint32_t version;       // 1
+    uint32_t width;         // Level 0 size in pixels
+    uint32_t height;
+    uint32_t tile_size;     // Tile edge in pixels
+    uint32_t levels;        // Mip levels
+};
+
+struct tiled_image_level
+{
+    uint32_t width;
+    uint32_t height;
+    uint32_t tiles_x;
+    uint32_t tiles_y;
+    uint64_t offset;        // File offset of the level's first tile
+};
+
+typedef std::vector<unsigned char> texture_tile;    // RGB texels, rows top to bottom
+
+struct texture_cache_stats
+{
+    uint64_t hits = 0;          // Tile requests found in the cache
+    uint64_t misses = 0;        // Tile requests read from disk
+    uint64_t evictions = 0;
+    size_t   resident_bytes = 0;
+    size_t   peak_bytes = 0;
+};
+
+class texture_cache
+{
+public:
+    std::string tile_directory = "texture_tiles";   // Where converted images are kept
+    int         tile_size = 64;                     // Tile edge for new conversions
+
+    static texture_cache& global()
+    {
+        static texture_cache cache;
+        return cache;
+    }
+
+    // Textures created after this stream through the cache. 0 disables it.
+    void enable(size_t budget_bytes) { budget = budget_bytes; }
+    bool enabled() const { return budget > 0; }
+    size_t budget_bytes() const { return budget; }
+
+    template <typename Loader>
+    shared_ptr<const texture_tile> get(uint64_t key, const Loader& load)
+    {
+        // Returns the tile for key, calling load() to read it on a miss. The tile stays valid
+        // for as long as the returned pointer is held, even if the cache evicts it.
+        auto& s = shards[key % shard_count];
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            auto found = s.tiles.find(key);
+            if(found != s.tiles.end())
+            {
+                s.lru.splice(s.lru.begin(), s.lru, found->second.position);
+                s.hits++;
+                return found->second.tile;
+            }
+        }
+
+        // Read outside the lock, so the shard's other tiles stay available meanwhile.
+        shared_ptr<const texture_tile> tile = load();
+
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.misses++;
+        auto found = s.tiles.find(key);
+        if(found != s.tiles.end()) return found->second.tile;  // Another thread was faster
+
+        s.lru.push_front(key);
+        s.tiles[key] = entry{ tile, s.lru.begin() };
+        s.bytes += tile->size();
+
+        // Each shard gets an equal part of the budget, and always keeps the tile just read.
+        while(s.bytes > budget / shard_count && s.lru.size() > 1)
+        {
+            auto victim = s.tiles.find(s.lru.back());
+            s.bytes -= victim->second.tile->size();
+            s.tiles.erase(victim);
+            s.lru.pop_back();
+            s.evictions++;
+        }
+        s.peak_bytes = std::max(s.peak_bytes, s.bytes);
+        return tile;
+    }
+
+    texture_cache_stats stats()
+    {
+        texture_cache_stats total;
+        for(auto& s : shards)
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            total.hits += s.hits;
+            total.misses += s.misses;
+            total.evictions += s.evictions;
+            total.resident_bytes += s.bytes;
+            total.peak_bytes += s.peak_bytes;  // Upper bound, shards peak at different times
+        }
+        return total;
+    }
+
+private:
+    static const int shard_count = 16;
+
+    struct entry
+    {
+        shared_ptr<const texture_tile> tile;
+        std::list<uint64_t>::iterator position;
+    };
+
+    struct shard
+    {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, entry> tiles;
+        std::list<uint64_t> lru;                    // Most recently used first
+        size_t bytes = 0;
+        size_t peak_bytes = 0;
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+    };
+
+    size_t budget = 0;
+    shard shards[shard_count];
+};
+
+class tiled_image
+{
+public:
+    // Opens the tiled version of an image file, converting it first if needed. The source is
+    // searched like rtw_image does. If neither works, width() and height() return 0.
+    tiled_image(const std::string& filename)
+    {
+        auto& cache = texture_cache::global();
+        auto path = cache.tile_directory + "/" + tiled_file_name(filename);
+
+        if(!open(path))
+        {
+            make_directory(cache.tile_directory);
+            if(!convert(filename, path, cache.tile_size) || !open(path))
+                std::cerr << "ERROR : Could not create the tiled texture '" << path << "'.\n";
+        }
+
+        static std::atomic<uint64_t> next_id(0);
+        id = ++next_id;
+    }
+
+    tiled_image(const tiled_image&) = delete;
+    tiled_image& operator=(const tiled_image&) = delete;
+
+    int width()  const { return header.levels > 0 ? int(header.width) : 0; }
+    int height() const { return header.levels > 0 ? int(header.height) : 0; }
+    int levels() const { return int(header.levels); }
+
+    void pixel_data(int x, int y, int level, unsigned char* rgb) const
+    {
+        // Copies the RGB bytes of the pixel at x,y of a mip level (clamped to the image).
+        // Without image data, returns magenta, like rtw_image.
+        if(header.levels == 0)
+        {
+            rgb[0] = 255; rgb[1] = 0; rgb[2] = 255;
+            return;
+        }
+
+        level = clamp(level, 0, int(header.levels));
+        const auto& lv = level_table[level];
+        x = clamp(x, 0, int(lv.width));
+        y = clamp(y, 0, int(lv.height));
+
+        int ts = int(header.tile_size);
+        uint64_t tile_index = uint64_t(y / ts) * lv.tiles_x + uint64_t(x / ts);
+        uint64_t key = (id << 48) | (uint64_t(level) << 40) | tile_index;
+
+        // The calling thread's last tile, checked before going to the shared cache.
+        struct last_tile
+        {
+            uint64_t key = 0;
+            shared_ptr<const texture_tile> tile;
+        };
+        static thread_local last_tile last;
+
+        if(last.key != key)   // Image ids start at 1, so no key is 0
+        {
+            last.tile = texture_cache::global().get(key, [&]() { return read_tile(lv, tile_index); });
+            last.key = key;
+        }
+
+        const unsigned char* texel = last.tile->data() + 3 * ((y % ts) * ts + (x % ts));
+        rgb[0] = texel[0];
+        rgb[1] = texel[1];
+        rgb[2] = texel[2];
+    }
+
+private:
+    uint64_t id = 0;                                // Unique per image, part of the tile keys
+    tiled_image_header header = tiled_image_header();
+    std::vector<tiled_image_level> level_table;
+    mutable std::ifstream file;
+    mutable std::mutex file_mutex;
+
+    static int clamp(int x, int low, int high)
+    {
+        // Return the value clamped to the range [low, high).
+        if (x < low)  return low;
+        if (x < high) return x;
+        return high - 1;
+    }
+
+    size_t tile_bytes() const { return size_t(3) * header.tile_size * header.tile_size; }
+
+    shared_ptr<const texture_tile> read_tile(const tiled_image_level& lv, uint64_t tile_index) const
+    {
+        auto tile = make_shared<texture_tile>(tile_bytes());
+
+        std::lock_guard<std::mutex> lock(file_mutex);
+        file.seekg(std::streamoff(lv.offset + tile_index * tile_bytes()));
+        file.read(reinterpret_cast<char*>(tile->data()), std::streamsize(tile->size()));
+        if(!file)
+        {
+            // Truncated file : keep rendering, with a magenta tile.
+            file.clear();
+            for(size_t k = 0; k < tile->size(); k += 3) { (*tile)[k] = 255; (*tile)[k+1] = 0; (*tile)[k+2] = 255; }
+        }
+        return tile;
+    }
+
+    bool open(const std::string& path)
+    {
+        file.open(path, std::ios::binary);
+        if(!file) return false;
+
+        tiled_image_header h;
+        file.read(reinterpret_cast<char*>(&h), sizeof(h));
+        if(!file || std::memcmp(h.magic, "RTTX", 4) != 0 || h.version != 1 || h.levels == 0 || h.tile_size == 0)
+        {
+            file.close();
+            return false;
+        }
+
+        level_table.resize(h.levels);
+        file.read(reinterpret_cast<char*>(level_table.data()), std::streamsize(h.levels * sizeof(tiled_image_level)));
+        if(!file)
+        {
+            file.close();
+            return false;
+        }
+
+        header = h;
+        return true;
+    }
+
+    static std::string tiled_file_name(const std::string& filename)
+    {
+        std::string name = filename;
+        for(auto& c : name)
+            if(c == '/' || c == '\\' || c == ':') c = '_';
+        return name + ".rtt";
+    }
+
+    static void make_directory(const std::string& directory)
+    {
+#ifndef _WIN32
+        ::mkdir(directory.c_str(), 0755);
+#else
+        ::_mkdir(directory.c_str());
+#endif
+    }
+
+    static bool convert(const std::string& source, const std::string& path, int tile_size)
+    {
+        // One time conversion. This is the only step that needs the whole image in memory.
+        std::vector<unsigned char> pixels;
+        tiled_image_header h;
+        {
+            // Decoded image released as soon as its bytes are copied.
+            rtw_image image(source);
+            if(image.height() <= 0) return false;
+
+            pixels.resize(size_t(3) * image.width() * image.height());
+            for(int y = 0; y < image.height(); y++)
+                for(int x = 0; x < image.width(); x++)
+                    std::memcpy(&pixels[3 * (size_t(y) * image.width() + x)], image.pixel_data(x, y), 3);
+
+            h.width = uint32_t(image.width());
+            h.height = uint32_t(image.height());
+        }
+
+        std::memcpy(h.magic, "RTTX", 4);
+        h.version = 1;
+        h.tile_size = uint32_t(tile_size);
+        h.levels = 1;
+        while((h.width >> h.levels) > 0 || (h.height >> h.levels) > 0) h.levels++;
+
+        std::vector<tiled_image_level> table(h.levels);
+        uint64_t offset = sizeof(h) + h.levels * sizeof(tiled_image_level);
+        for(uint32_t k = 0; k < h.levels; k++)
+        {
+            auto& lv = table[k];
+            lv.width = std::max(1u, h.width >> k);
+            lv.height = std::max(1u, h.height >> k);
+            lv.tiles_x = (lv.width + h.tile_size - 1) / h.tile_size;
+            lv.tiles_y = (lv.height + h.tile_size - 1) / h.tile_size;
+            lv.offset = offset;
+            offset += uint64_t(lv.tiles_x) * lv.tiles_y * 3 * h.tile_size * h.tile_size;
+        }
+
+        // Written under a temporary name and renamed when complete, so an interrupted
+        // conversion never leaves a file that looks valid.
+        auto temporary = path + ".tmp";
+        std::ofstream out(temporary, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+        out.write(reinterpret_cast<const char*>(table.data()), std::streamsize(table.size() * sizeof(tiled_image_level)));
+
+        std::vector<unsigned char> tile(size_t(3) * tile_size * tile_size);
+        for(uint32_t k = 0; k < h.levels; k++)
+        {
+            const auto& lv = table[k];
+            if(k > 0) pixels = downsample(pixels, table[k-1].width, table[k-1].height, lv.width, lv.height);
+
+            for(uint32_t ty = 0; ty < lv.tiles_y; ty++)
+            {
+                for(uint32_t tx = 0; tx < lv.tiles_x; tx++)
+                {
+                    for(int y = 0; y < tile_size; y++)
+                    {
+                        for(int x = 0; x < tile_size; x++)
+                        {
+                            auto px = std::min(lv.width - 1, tx * h.tile_size + uint32_t(x));
+                            auto py = std::min(lv.height - 1, ty * h.tile_size + uint32_t(y));
+                            std::memcpy(&tile[3 * (size_t(y) * tile_size + x)], &pixels[3 * (size_t(py) * lv.width + px)], 3);
+                        }
+                    }
+                    out.write(reinterpret_cast<const char*>(tile.data()), std::streamsize(tile.size()));
+                }
+            }
+        }
+
+        out.close();
+        if(!out) return false;
+        std::remove(path.c_str());
+        return std::rename(temporary.c_str(), path.c_str()) == 0;
+    }
+
+    static std::vector<unsigned char> downsample(
+        const std::vector<unsigned char>& pixels, uint32_t width, uint32_t height, uint32_t out_width, uint32_t out_height
+    )
+    {
+        // 2x2 box filter. (a dimension already at 1 pixel isn't halved)
+        std::vector<unsigned char> out(size_t(3) * out_width * out_height);
+        for(uint32_t y = 0; y < out_height; y++)
+        {
+            for(uint32_t x = 0; x < out_width; x++)
+            {
+                uint32_t x0 = std::min(2*x, width - 1), x1 = std::min(2*x + 1, width - 1);
+                uint32_t y0 = std::min(2*y, height - 1), y1 = std::min(2*y + 1, height - 1);
+                for(int c = 0; c < 3; c++)
+                {
+                    int sum = pixels[3 * (size_t(y0) * width + x0) + c] + pixels[3 * (size_t(y0) * width + x1) + c]
+                            + pixels[3 * (size_t(y1) * width + x0) + c] + pixels[3 * (size_t(y1) * width + x1) + c];
+                    out[3 * (size_t(y) * out_width + x) + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        return out;
+    }
+};
+
+#endif
@@ -0,0 +1,186 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include "numa.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads pulling tasks from one queue.
+// Threads are created once and reused, so rendering many tiles (or many images)
+// doesn't pay thread start up costs again and again.
+class thread_pool
+{
+public:
+    // thread_count <= 0 : one thread per hardware thread
+    // pin : bind every thread to one CPU, spread over the NUMA nodes (see parallel_for)
+    thread_pool(int thread_count = 0, bool pin = false)
+    {
+        if(thread_count <= 0) thread_count = int(std::thread::hardware_concurrency());
+        if(thread_count <= 0) thread_count = 1;
+
+        // CPUs taken node by node in turn (first CPU of every node, then the second ...), so
+        // a pool smaller than the machine still uses all of its nodes.
+        const numa_topology& topology = numa_topology::system();
+        std::vector<std::pair<int, int>> slots;     // (node, cpu)
+        if(pin)
+        {
+            for(size_t k = 0; slots.size() < size_t(thread_count); k++)
+            {
+                bool any = false;
+                for(int n = 0; n < topology.node_count(); n++)
+                {
+                    if(k >= topology.nodes[n].cpus.size()) continue;
+                    slots.push_back(std::make_pair(n, topology.nodes[n].cpus[k]));
+                    any = true;
+                }
+                if(!any) break;
+            }
+            for(int n = 0; n < topology.node_count(); n++)
+                steal_orders.push_back(topology.steal_order(n));
+        }
+        else steal_orders.push_back(std::vector<int>());
+        node_threads.assign(steal_orders.size(), 0);
+
+        for(int t = 0; t < thread_count; t++)
+        {
+            int node = 0, cpu = -1;
+            if(pin)
+            {
+                // More threads than CPUs wrap around
+                node = slots[t % slots.size()].first;
+                cpu = slots[t % slots.size()].second;
+            }
+            node_threads[node]++;
+            workers.emplace_back([this, node, cpu, t]
+            {
+                if(cpu >= 0) pin_current_thread(std::vector<int>(1, cpu));
+                current_node() = node;
+                // Materials drawing from random_double() get a different sequence per thread
+                seed_random_generators(unsigned(t) + 1);
+                worker_loop();
+            });
+        }
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            stopping = true;
+        }
+        queue_ready.notify_all();
+        for(auto& worker : workers) worker.join();
+    }
+
+    thread_pool(const thread_pool&) = delete;
+    thread_pool& operator=(const thread_pool&) = delete;
+
+    int size() const { return int(workers.size()); }
+
+    // Nodes the pool's threads are on : the NUMA nodes for a pinned pool, a single one otherwise.
+    int node_count() const { return int(node_threads.size()); }
+    int threads_on_node(int node) const { return node_threads[node]; }
+
+    // Node of the calling pool thread, 0 for threads outside any pool.
+    static int& current_node()
+    {
+        static thread_local int node = 0;
+        return node;
+    }
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            tasks.push(std::move(task));
+        }
+        queue_ready.notify_one();
+    }
+
+    void parallel_for(int count, const std::function<void(int)>& body)
+    {
+        // Calls body(0) ... body(count-1) across the pool and returns when all are done.
+        // Indices are handed out one at a time, so uneven items (tiles with more geometry
+        // in them) balance themselves. Must not be called from inside a pool task.
+        //
+        // The range is split into one contiguous part per node, sized by the node's thread
+        // count. Neighbouring items (tiles, rows) touch neighbouring scene and framebuffer
+        // data, so a node's threads share the items of their own part first, then steal from
+        // the other nodes' parts, nearest node first.
+        if(count <= 0) return;
+
+        std::vector<node_range> ranges(node_count());
+        int begin = 0, threads_before = 0;
+        for(int n = 0; n < node_count(); n++)
+        {
+            threads_before += node_threads[n];
+            ranges[n].next = begin;
+            ranges[n].end = int(int64_t(count) * threads_before / size());
+            begin = ranges[n].end;
+        }
+
+        int runners = std::min(size(), count);
+        int finished = 0;
+        std::mutex done_mutex;
+        std::condition_variable done;
+
+        for(int r = 0; r < runners; r++)
+        {
+            submit([&] {
+                int node = current_node();
+                for(int index = ranges[node].next++; index < ranges[node].end; index = ranges[node].next++)
+                    body(index);
+                for(int victim : steal_orders[node])
+                    for(int index = ranges[victim].next++; index < ranges[victim].end; index = ranges[victim].next++)
+                        body(index);
+
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if(++finished == runners) done.notify_one();
+            });
+        }
+
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done.wait(lock, [&] { return finished == runners; });
+    }
+
+private:
+    struct node_range
+    {
+        std::atomic<int> next;  // Next item to hand out
+        int end;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<int> node_threads;                  // Thread count per node
+    std::vector<std::vector<int>> steal_orders;     // Per node, the other nodes nearest first
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    bool stopping = false;
+
+    void worker_loop()
+    {
+        while(true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                queue_ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                if(stopping && tasks.empty()) return;
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+};
+
+#endif
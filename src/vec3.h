@@ -4,30 +4,55 @@
 // most 3D graphics systems uses 4d homogenous coors, but
 // our project, 3d coor. system might suffice.
 
+// With RT_SIMD (cmake -DRT_SIMD=ON), vec3 is padded to 4 lanes and its arithmetic goes
+// through simd.h. The API doesn't change, e[0..2] are still the components. (e[3] is padding,
+// its value is meaningless)
+#ifdef RT_SIMD
+    #include "simd.h"
+#endif
+
 /* Class declariation */ 
 class vec3 {
 public:
     // Here, double precision is used, 
     // but in some scenarios, single precision 'float' type 
     // might be better option for limited memory conditions.
+#ifdef RT_SIMD
+    alignas(16) double e[4];
+
+    vec3() : e{0,0,0,0} {}
+    vec3(double e0, double e1, double e2) : e{e0, e1, e2, 0} {}
+    explicit vec3(const double4& lanes) { lanes.store(e); }
+
+    double4 lanes() const { return double4::load(e); }
+#else
     double e[3]; 
 
     vec3() : e{0,0,0} {}
     vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+#endif
 
     double x() const { return e[0]; }
     double y() const { return e[1]; }
     double z() const { return e[2]; }
 
+#ifdef RT_SIMD
+    vec3 operator-() const { return vec3(double4::splat(-1) * lanes()); }
+#else
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+#endif
     double operator[](int i) const { return e[i]; }  // return value
     double& operator[](int i) { return e[i]; }  // return ref
 
     vec3& operator+=(const vec3& v)
     {
+#ifdef RT_SIMD
+        (lanes() + v.lanes()).store(e);
+#else
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
+#endif
         return *this;  
         // Must return reference type.
         // When return value type, 
@@ -36,9 +61,13 @@ public:
 
     vec3& operator*=(double t)
     {
+#ifdef RT_SIMD
+        (double4::splat(t) * lanes()).store(e);
+#else
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
+#endif
         return *this;
     }
 
@@ -47,7 +76,16 @@ public:
         return *this *= 1/t;
     }
 
+#ifdef RT_SIMD
+    double length_squared() const
+    {
+        double p[4];
+        (lanes() * lanes()).store(p);
+        return p[0] + p[1] + p[2];
+    }
+#else
     double length_squared() const { return e[0]*e[0]+e[1]*e[1]+e[2]*e[2]; }
+#endif
     double length() const { return std::sqrt(length_squared()); }
 
     // Returns [0,1) ranged vector
@@ -96,22 +134,38 @@ inline bool operator==(const vec3& u, const vec3& v)
 // element-wise vec3 operation (Hadamard product)
 inline vec3 operator+(const vec3& u, const vec3& v)
 {
+#ifdef RT_SIMD
+    return vec3(u.lanes() + v.lanes());
+#else
     return vec3(u.e[0]+v.e[0], u.e[1]+v.e[1], u.e[2]+v.e[2]);
+#endif
 }
 
 inline vec3 operator-(const vec3& u, const vec3& v)
 {
+#ifdef RT_SIMD
+    return vec3(u.lanes() - v.lanes());
+#else
     return vec3(u.e[0] - v.e[0], u.e[1] - v.e[1], u.e[2] - v.e[2]);
+#endif
 }
 
 inline vec3 operator*(const vec3& u, const vec3& v)
 {
+#ifdef RT_SIMD
+    return vec3(u.lanes() * v.lanes());
+#else
     return vec3(u.e[0] * v.e[0], u.e[1] * v.e[1], u.e[2] * v.e[2]);
+#endif
 }
 
 inline vec3 operator*(double t, const vec3& v)
 {
+#ifdef RT_SIMD
+    return vec3(double4::splat(t) * v.lanes());
+#else
     return vec3(t*v.e[0], t*v.e[1], t*v.e[2]);
+#endif
 }
 
 inline vec3 operator*(const vec3& v, double t)
@@ -128,17 +182,29 @@ inline vec3 operator/(const vec3& v, double t)
 // dot product (scalar)
 inline double dot(const vec3& u, const vec3& v)
 {
+#ifdef RT_SIMD
+    // Lane products, then summed in the scalar order so both builds round the same way.
+    double p[4];
+    (u.lanes() * v.lanes()).store(p);
+    return p[0] + p[1] + p[2];
+#else
     return u.e[0] * v.e[0]
          + u.e[1] * v.e[1]
          + u.e[2] * v.e[2];
+#endif
 }
 
 // cross product (vector)
 inline vec3 cross(const vec3& u, const vec3& v)
 {
+#ifdef RT_SIMD
+    auto a = u.lanes(), b = v.lanes();
+    return vec3(a.yzx() * b.zxy() - a.zxy() * b.yzx());
+#else
     return vec3(u.e[1]*v.e[2] - u.e[2]*v.e[1],
                 u.e[2]*v.e[0] - u.e[0]*v.e[2],
                 u.e[0]*v.e[1] - u.e[1]*v.e[0]);
+#endif
 }
 
 inline vec3 unit_vector(const vec3& v)
@@ -147,74 +213,124 @@ inline vec3 unit_vector(const vec3& v)
     return v / v.length();
 }
 
-inline vec3 random_unit_vector()
+inline vec3 reflect(const vec3& v, const vec3& n)
 {
-    while(1)
-    {
-        auto p = vec3::random(-1,1);
-        auto lensq = p.length_squared();
-    
-        if(1e-160 < lensq && lensq <= 1)
-        {
-            return p / sqrt(lensq);
-            // don't use p.length() for calling overhead
-        } 
-        // With very small valued element vector, it can underflow to 0
-        // and normalizing this vector results in [+-inf, +-inf, +-inf]
-        // Thus, we have to cut off small values and double precision type
-        // guarantees that the values greater than 10^-160 (=1e-160)
-    }
-    // Using rejection sampling method.
-    // Might worry about while loop overhead. 
-    // Total sample area is 2*2*2 cube, and sample accepting area is 4/3*pi*1. 
-    // So rejection rate is 1-[(4/3*pi) / 8] = 0.476 = 47%, and 47%+ due to
-    // rejecting small vectors.
-    // Expected value E can be calculated in "E = 1/p", where p is probability 
-    // to be accepcted. (Look for "Geometric Distribution")
-    // so, let p = 47%+ = approximatly 50%, than, E = 1/(50%) = 2. Thus, 
-    // random vector can be expected to be accepted in 2 loops.
-    // Acutal test result can be seen in /note/loop count test.cc
+    return v - 2*dot(v,n)*n;
 }
 
-inline vec3 random_in_unit_disk()
+inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
 {
-    while(1)
+    // uv : unit incident ray, n : normal, etai_over_etat : refraction index rate (n_i / n_t)
+    // NOTE : why use just fmin?
+    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
+
+    vec3 r_out_perp = etai_over_etat * (uv + cos_theta*n);
+    vec3 r_out_para = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
+    return r_out_perp + r_out_para;
+}
+
+/* Batched vectors */
+// N vectors stored as structure of arrays (all x, then all y, then all z), for code that 
+// handles several rays or primitives at once. The lane loops are plain loops over
+// contiguous arrays, which the compiler turns into SIMD code in either build.
+template <int N>
+struct vec3xN
+{
+    double x[N];
+    double y[N];
+    double z[N];
+
+    static vec3xN broadcast(const vec3& v)
+    {
+        vec3xN r;
+        for(int k = 0; k < N; k++) r.set(k, v);
+        return r;
+    }
+
+    static vec3xN gather(const vec3* v)
     {
-        auto p = vec3(random_double(-1,1), random_double(-1,1), 0);
-        auto lensq = p.length_squared();
-    
-        if(1e-160 < lensq && lensq <= 1)
-        {
-            return p / sqrt(lensq);
-            // don't use p.length() for calling overhead
-        } 
-
-        // NOTE : why no small value filtering and overhead calling lenght_saured is not used?
+        // N consecutive vec3s.
+        vec3xN r;
+        for(int k = 0; k < N; k++) r.set(k, v[k]);
+        return r;
     }
+
+    vec3 get(int k) const { return vec3(x[k], y[k], z[k]); }
+
+    void set(int k, const vec3& v)
+    {
+        x[k] = v.x();
+        y[k] = v.y();
+        z[k] = v.z();
+    }
+};
+
+typedef vec3xN<4> vec3x4;
+typedef vec3xN<8> vec3x8;
+
+template <int N>
+inline vec3xN<N> operator+(const vec3xN<N>& u, const vec3xN<N>& v)
+{
+    vec3xN<N> r;
+    for(int k = 0; k < N; k++) r.x[k] = u.x[k] + v.x[k];
+    for(int k = 0; k < N; k++) r.y[k] = u.y[k] + v.y[k];
+    for(int k = 0; k < N; k++) r.z[k] = u.z[k] + v.z[k];
+    return r;
 }
 
-// Depreicated at Chapter 9. Replaced with "random_unit_vector()"
-inline vec3 random_on_hemisphere(const vec3& normal)
+template <int N>
+inline vec3xN<N> operator-(const vec3xN<N>& u, const vec3xN<N>& v)
 {
-    vec3 on_unit_sphere = random_unit_vector();
-    // In the same hemisphere as the normal (pointing out from surface)
-    if(dot(on_unit_sphere, normal) > 0.0) return on_unit_sphere;
-    else return -on_unit_sphere;
+    vec3xN<N> r;
+    for(int k = 0; k < N; k++) r.x[k] = u.x[k] - v.x[k];
+    for(int k = 0; k < N; k++) r.y[k] = u.y[k] - v.y[k];
+    for(int k = 0; k < N; k++) r.z[k] = u.z[k] - v.z[k];
+    return r;
 }
 
-inline vec3 reflect(const vec3& v, const vec3& n)
+template <int N>
+inline vec3xN<N> operator*(const vec3xN<N>& u, const vec3xN<N>& v)
 {
-    return v - 2*dot(v,n)*n;
+    vec3xN<N> r;
+    for(int k = 0; k < N; k++) r.x[k] = u.x[k] * v.x[k];
+    for(int k = 0; k < N; k++) r.y[k] = u.y[k] * v.y[k];
+    for(int k = 0; k < N; k++) r.z[k] = u.z[k] * v.z[k];
+    return r;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat)
+template <int N>
+inline vec3xN<N> operator*(const double (&t)[N], const vec3xN<N>& v)
 {
-    // uv : unit incident ray, n : normal, etai_over_etat : refraction index rate (n_i / n_t)
-    // NOTE : why use just fmin?
-    auto cos_theta = std::fmin(dot(-uv, n), 1.0);
+    // Lane k scaled by t[k].
+    vec3xN<N> r;
+    for(int k = 0; k < N; k++) r.x[k] = t[k] * v.x[k];
+    for(int k = 0; k < N; k++) r.y[k] = t[k] * v.y[k];
+    for(int k = 0; k < N; k++) r.z[k] = t[k] * v.z[k];
+    return r;
+}
 
-    vec3 r_out_perp = etai_over_etat * (uv + cos_theta*n);
-    vec3 r_out_para = -std::sqrt(std::fabs(1.0 - r_out_perp.length_squared())) * n;
-    return r_out_perp + r_out_para;
+template <int N>
+inline void dot(const vec3xN<N>& u, const vec3xN<N>& v, double (&out)[N])
+{
+    for(int k = 0; k < N; k++) out[k] = u.x[k] * v.x[k] + u.y[k] * v.y[k] + u.z[k] * v.z[k];
+}
+
+template <int N>
+inline vec3xN<N> cross(const vec3xN<N>& u, const vec3xN<N>& v)
+{
+    vec3xN<N> r;
+    for(int k = 0; k < N; k++) r.x[k] = u.y[k] * v.z[k] - u.z[k] * v.y[k];
+    for(int k = 0; k < N; k++) r.y[k] = u.z[k] * v.x[k] - u.x[k] * v.z[k];
+    for(int k = 0; k < N; k++) r.z[k] = u.x[k] * v.y[k] - u.y[k] * v.x[k];
+    return r;
+}
+
+template <int N>
+inline vec3xN<N> unit_vector(const vec3xN<N>& v)
+{
+    double length_squared[N], scale[N];
+    dot(v, v, length_squared);
+    for(int k = 0; k < N; k++) scale[k] = 1 / std::sqrt(length_squared[k]);
+    return scale * v;
 }
 #endif
\ No newline at end of file
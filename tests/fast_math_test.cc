@@ -0,0 +1,161 @@
+// fast_math.h : the approximations against libm over their domains, with the maximum errors
+// documented in the header, and a render with camera::fast_math on against the exact one.
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "camera.h"
+#include "material.h"
+#include "sphere.h"
+#include "texture.h"
+
+#include <cstdio>
+#include <random>
+
+static int failures = 0;
+
+static void check_bound(const char* name, double max_error, double bound)
+{
+    bool ok = max_error <= bound;
+    if(!ok) failures++;
+    std::printf("%-16s max error %.3g (bound %.3g) %s\n", name, max_error, bound, ok ? "ok" : "FAIL");
+}
+
+static void test_error_bounds()
+{
+    std::mt19937 rng(42);
+    const int points = 2000000;
+
+    // acos over [-1,1] : evenly spaced, endpoints included
+    double acos_error = 0;
+    for(int k = 0; k <= points; k++)
+    {
+        double x = -1 + 2.0 * k / points;
+        acos_error = std::fmax(acos_error, std::fabs(approx_acos(x) - std::acos(x)));
+    }
+    check_bound("approx_acos", acos_error, 2.2e-8);
+
+    // atan2 : all directions, magnitudes over many octaves, the axes and signed zeros
+    std::uniform_real_distribution<double> angle(-pi, pi);
+    std::uniform_int_distribution<int> exponent(-30, 30);
+    double atan2_error = 0;
+    for(int k = 0; k < points; k++)
+    {
+        double a = angle(rng);
+        double length = std::ldexp(1.0, exponent(rng));
+        double y = length * std::sin(a), x = length * std::cos(a);
+        atan2_error = std::fmax(atan2_error, std::fabs(approx_atan2(y, x) - std::atan2(y, x)));
+    }
+    const double axes[][2] = { {0,1}, {1,0}, {0,-1}, {-1,0}, {-0.0,1}, {-0.0,-1}, {0,0}, {1,1}, {-1,-1} };
+    for(const auto& p : axes)
+        atan2_error = std::fmax(atan2_error, std::fabs(approx_atan2(p[0], p[1]) - std::atan2(p[0], p[1])));
+    check_bound("approx_atan2", atan2_error, 1.4e-8);
+
+    // sin and cos over |x| < 1e4 : random points, plus the multiples of pi/4 near the
+    // quadrant boundaries of the reduction
+    std::uniform_real_distribution<double> argument(-1e4, 1e4);
+    double sin_cos_error = 0;
+    auto sin_cos_at = [&](double x)
+    {
+        double s, c;
+        approx_sin_cos(x, s, c);
+        sin_cos_error = std::fmax(sin_cos_error, std::fmax(std::fabs(s - std::sin(x)), std::fabs(c - std::cos(x))));
+    };
+    for(int k = 0; k < points; k++) sin_cos_at(argument(rng));
+    for(int k = -12732; k <= 12732; k++) sin_cos_at(k * pi / 4);
+    check_bound("approx_sin_cos", sin_cos_error, 7.0e-12);
+
+    // pow5 : error in ulps of the result, over many magnitudes and both signs
+    std::uniform_real_distribution<double> mantissa(-2, 2);
+    double pow5_ulps = 0;
+    for(int k = 0; k < points; k++)
+    {
+        double x = std::ldexp(mantissa(rng), exponent(rng) / 3);
+        double exact = std::pow(x, 5);
+        if(exact == 0) continue;
+        double ulp = std::nextafter(std::fabs(exact), INFINITY) - std::fabs(exact);
+        pow5_ulps = std::fmax(pow5_ulps, std::fabs(pow5(x) - exact) / ulp);
+    }
+    check_bound("pow5 (ulp)", pow5_ulps, 3);
+}
+
+// Stripes in u and v, so errors in the sphere's surface coordinates show in the image.
+class uv_stripes : public texture
+{
+public:
+    color value(double u, double v, const point3& p) const override
+    {
+        bool stripe = (int(u * 48) + int(v * 24)) % 2 == 0;
+        return stripe ? color(0.9, 0.2, 0.1) : color(0.9, 0.9, 0.8);
+    }
+};
+
+static framebuffer render(bool fast_math)
+{
+    // A scene touching every approximated call : textured spheres (acos, atan2), glass
+    // (Schlick's pow5), and diffuse bounces and a sampled light (sin and cos).
+    scene_arena arena;
+    hittable_list world, lights;
+    world.add(arena.make<sphere>(point3(0,-1000,0), 1000, arena.make<lambertian>(arena.make<uv_stripes>())));
+    world.add(arena.make<sphere>(point3(-2.2,1,0), 1.0, arena.make<lambertian>(arena.make<uv_stripes>())));
+    world.add(arena.make<sphere>(point3(0,1,0), 1.0, arena.make<dielectric>(1.5)));
+    world.add(arena.make<sphere>(point3(2.2,1,0), 1.0, arena.make<metal>(color(0.7, 0.6, 0.5), 0.2)));
+    auto light = arena.make<sphere>(point3(0,5,2), 1.0, arena.make<diffuse_light>(color(6,6,6)));
+    world.add(light);
+    lights.add(light);
+    bvh_node bvh(world);
+
+    camera cam;
+    cam.image_width = 160;
+    cam.aspect_ratio = 16.0 / 9.0;
+    cam.samples_per_pixel = 32;
+    cam.max_depth = 10;
+    cam.vfov = 30;
+    cam.lookfrom = point3(0, 3, 10);
+    cam.lookat = point3(0, 1, 0);
+    cam.fast_math = fast_math;
+    cam.initialize();
+
+    render_job_desc job;
+    job.x1 = cam.image_width;
+    job.y1 = cam.height();
+    job.sample_end = cam.samples_per_pixel;
+    return cam.render_job(bvh, &lights, job);
+}
+
+// RMSE of the two images once written out as bytes, over [0,1].
+static double byte_rmse(const framebuffer& a, const framebuffer& b)
+{
+    double sum = 0;
+    for(size_t k = 0; k < a.beauty.size(); k++)
+        for(int c = 0; c < 3; c++)
+        {
+            double d = (linear_to_byte(a.beauty[k][c]) - linear_to_byte(b.beauty[k][c])) / 255.0;
+            sum += d * d;
+        }
+    return a.beauty.empty() ? 0 : std::sqrt(sum / (3 * a.beauty.size()));
+}
+
+static void test_image_difference()
+{
+    // Same samples, so the images only differ by where the approximations move a ray.
+    // Limit : an RMSE of 0.002 over the written bytes. The unquantized pixels have to differ
+    // though, or the render threads didn't pick up the camera's mode.
+    auto exact = render(false);
+    auto fast = render(true);
+    bool used = false;
+    for(size_t k = 0; k < exact.beauty.size(); k++)
+        for(int c = 0; c < 3; c++) used = used || exact.beauty[k][c] != fast.beauty[k][c];
+    double rmse = byte_rmse(exact, fast);
+    bool ok = used && rmse <= 0.002;
+    if(!ok) failures++;
+    std::printf("%-16s rmse %.5f (limit 0.002)%s %s\n", "render", rmse, used ? "" : ", same pixels", ok ? "ok" : "FAIL");
+}
+
+int main()
+{
+    test_error_bounds();
+    test_image_difference();
+    std::printf("%s\n", failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}
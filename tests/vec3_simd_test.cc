@@ -0,0 +1,180 @@
+// vec3 and vec3x4 / vec3x8 against the scalar formulas, lane by lane.
+//
+// Built once as the scalar vec3 and once per SIMD path (see CMakeLists.txt). Every operation
+// must give bit for bit the result of the scalar code, which is written out here the way the
+// scalar vec3 computes it. With RT_SIMD the double4 lane operations and shuffles are checked
+// on their own too.
+
+#include "rtweekend.h"
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+static int failures = 0;
+
+static bool same(double a, double b) { return std::memcmp(&a, &b, sizeof(double)) == 0; }
+
+static void check(bool ok, const char* what, int index)
+{
+    if(ok) return;
+    failures++;
+    if(failures <= 20) std::printf("FAIL %s (case %d)\n", what, index);
+}
+
+static void check_vec3(const vec3& v, double x, double y, double z, const char* what, int index)
+{
+    check(same(v.x(), x) && same(v.y(), y) && same(v.z(), z), what, index);
+}
+
+static std::vector<vec3> test_vectors()
+{
+    // Random components over a wide range of magnitudes and signs, plus the special cases.
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<double> mantissa(-1, 1);
+    std::uniform_int_distribution<int> exponent(-20, 20);
+    std::vector<vec3> vectors = { vec3(0,0,0), vec3(1,0,0), vec3(0,-1,0), vec3(0,0,1e-300), vec3(1e300,-1e300,1) };
+    for(int k = 0; k < 2000; k++)
+    {
+        double c[3];
+        for(auto& x : c) x = std::ldexp(mantissa(rng), exponent(rng));
+        vectors.push_back(vec3(c[0], c[1], c[2]));
+    }
+    return vectors;
+}
+
+static void test_vec3(const std::vector<vec3>& vectors)
+{
+    for(size_t k = 0; k + 1 < vectors.size(); k++)
+    {
+        const vec3& u = vectors[k];
+        const vec3& v = vectors[k + 1];
+        int n = int(k);
+        double t = v.y();
+
+        check_vec3(u + v, u.x() + v.x(), u.y() + v.y(), u.z() + v.z(), "operator+", n);
+        check_vec3(u - v, u.x() - v.x(), u.y() - v.y(), u.z() - v.z(), "operator-", n);
+        check_vec3(u * v, u.x() * v.x(), u.y() * v.y(), u.z() * v.z(), "operator* (vec3)", n);
+        check_vec3(t * u, t * u.x(), t * u.y(), t * u.z(), "operator* (scalar)", n);
+        check_vec3(-u, -u.x(), -u.y(), -u.z(), "negation", n);
+
+        vec3 sum = u;
+        sum += v;
+        check_vec3(sum, u.x() + v.x(), u.y() + v.y(), u.z() + v.z(), "operator+=", n);
+        vec3 scaled = u;
+        scaled *= t;
+        check_vec3(scaled, t * u.x(), t * u.y(), t * u.z(), "operator*=", n);
+
+        double length_squared = u.x()*u.x() + u.y()*u.y() + u.z()*u.z();
+        check(same(u.length_squared(), length_squared), "length_squared", n);
+        check(same(dot(u, v), u.x() * v.x() + u.y() * v.y() + u.z() * v.z()), "dot", n);
+        check_vec3(cross(u, v), u.y()*v.z() - u.z()*v.y(), u.z()*v.x() - u.x()*v.z(), u.x()*v.y() - u.y()*v.x(), "cross", n);
+
+        if(length_squared > 0)
+        {
+            double scale = 1 / std::sqrt(length_squared);
+            check_vec3(unit_vector(u), scale * u.x(), scale * u.y(), scale * u.z(), "unit_vector", n);
+        }
+    }
+}
+
+template <int N>
+static void test_vec3xN(const std::vector<vec3>& vectors, const char* name)
+{
+    // Each lane against the vec3 operation on the same inputs.
+    char what[64];
+    for(size_t k = 0; k + 2 * N <= vectors.size(); k += N)
+    {
+        auto u = vec3xN<N>::gather(&vectors[k]);
+        auto v = vec3xN<N>::gather(&vectors[k + N]);
+        double t[N], dots[N];
+        for(int lane = 0; lane < N; lane++) t[lane] = vectors[k + N + lane].z();
+
+        auto sum = u + v;
+        auto difference = u - v;
+        auto product = u * v;
+        auto scaled = t * u;
+        auto crossed = cross(u, v);
+        auto unit = unit_vector(u);
+        dot(u, v, dots);
+
+        for(int lane = 0; lane < N; lane++)
+        {
+            int n = int(k) + lane;
+            vec3 a = u.get(lane), b = v.get(lane);
+            auto lane_check = [&](const vec3& got, const vec3& expected, const char* op)
+            {
+                std::snprintf(what, sizeof(what), "%s %s", name, op);
+                check_vec3(got, expected.x(), expected.y(), expected.z(), what, n);
+            };
+            lane_check(sum.get(lane), a + b, "operator+");
+            lane_check(difference.get(lane), a - b, "operator-");
+            lane_check(product.get(lane), a * b, "operator*");
+            lane_check(scaled.get(lane), t[lane] * a, "lane scale");
+            lane_check(crossed.get(lane), cross(a, b), "cross");
+            if(a.length_squared() > 0) lane_check(unit.get(lane), unit_vector(a), "unit_vector");
+
+            std::snprintf(what, sizeof(what), "%s dot", name);
+            check(same(dots[lane], dot(a, b)), what, n);
+        }
+    }
+}
+
+#ifdef RT_SIMD
+static void test_double4(const std::vector<vec3>& vectors)
+{
+    // Lane operations, shuffles and min/max of the selected SIMD path.
+    for(size_t k = 0; k + 1 < vectors.size(); k++)
+    {
+        int n = int(k);
+        double a[4] = { vectors[k].x(), vectors[k].y(), vectors[k].z(), vectors[k + 1].x() };
+        double b[4] = { vectors[k + 1].x(), vectors[k + 1].y(), vectors[k + 1].z(), vectors[k].z() };
+        auto x = double4::load(a), y = double4::load(b);
+        double r[4];
+
+        auto lanes_are = [&](double4 value, double e0, double e1, double e2, double e3, const char* what)
+        {
+            value.store(r);
+            check(same(r[0], e0) && same(r[1], e1) && same(r[2], e2) && same(r[3], e3), what, n);
+        };
+        lanes_are(x + y, a[0]+b[0], a[1]+b[1], a[2]+b[2], a[3]+b[3], "double4 +");
+        lanes_are(x - y, a[0]-b[0], a[1]-b[1], a[2]-b[2], a[3]-b[3], "double4 -");
+        lanes_are(x * y, a[0]*b[0], a[1]*b[1], a[2]*b[2], a[3]*b[3], "double4 *");
+        if(b[0] != 0 && b[1] != 0 && b[2] != 0 && b[3] != 0)
+            lanes_are(x / y, a[0]/b[0], a[1]/b[1], a[2]/b[2], a[3]/b[3], "double4 /");
+        lanes_are(min(x, y), a[0] < b[0] ? a[0] : b[0], a[1] < b[1] ? a[1] : b[1],
+                  a[2] < b[2] ? a[2] : b[2], a[3] < b[3] ? a[3] : b[3], "double4 min");
+        lanes_are(max(x, y), a[0] > b[0] ? a[0] : b[0], a[1] > b[1] ? a[1] : b[1],
+                  a[2] > b[2] ? a[2] : b[2], a[3] > b[3] ? a[3] : b[3], "double4 max");
+        lanes_are(double4::splat(a[1]), a[1], a[1], a[1], a[1], "double4 splat");
+        lanes_are(x.yzx(), a[1], a[2], a[0], a[3], "double4 yzx");
+        lanes_are(x.zxy(), a[2], a[0], a[1], a[3], "double4 zxy");
+    }
+}
+#endif
+
+int main()
+{
+#if defined(RT_SIMD_AVX) && defined(__AVX2__)
+    const char* path = "AVX2";
+#elif defined(RT_SIMD_AVX)
+    const char* path = "AVX";
+#elif defined(RT_SIMD_SSE2)
+    const char* path = "SSE2";
+#elif defined(RT_SIMD)
+    const char* path = "portable double4";
+#else
+    const char* path = "scalar vec3";
+#endif
+
+    auto vectors = test_vectors();
+    test_vec3(vectors);
+    test_vec3xN<4>(vectors, "vec3x4");
+    test_vec3xN<8>(vectors, "vec3x8");
+#ifdef RT_SIMD
+    test_double4(vectors);
+#endif
+
+    std::printf("%s : %s\n", path, failures == 0 ? "passed" : "FAILED");
+    return failures == 0 ? 0 : 1;
+}